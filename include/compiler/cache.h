@@ -0,0 +1,78 @@
+// Copyright (c) 2020-2021 by the Zeek Project. See LICENSE for details.
+
+#pragma once
+
+#include <optional>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <hilti/rt/filesystem.h>
+
+#include <hilti/base/result.h>
+
+namespace spicy::zeek {
+
+/**
+ * Persistent, content-addressed cache for `*.hlto` files produced by
+ * `spicyz`.
+ *
+ * Entries are keyed by a digest over the contents and paths of all inputs,
+ * the command line options affecting code generation, the environment
+ * variables controlling module search paths and C++ compilation, and the
+ * versions of Spicy, Zeek, and the plugin. Each entry also records the
+ * source files the compilation ended up reading (e.g., through imports), and
+ * a lookup only hits if all of them still have the same content. Otherwise,
+ * the recompiled output replaces the entry. An entry may also carry the
+ * analyzer index written with `--write-index`.
+ */
+class CompilationCache {
+public:
+    /**
+     * Constructor.
+     *
+     * @param dir directory to store cache entries in; will be created if it doesn't exist
+     */
+    explicit CompilationCache(hilti::rt::filesystem::path dir) : _dir(std::move(dir)) {}
+
+    /**
+     * Computes the cache key for a compilation.
+     *
+     * @param inputs input files passed to the compiler
+     * @param options string representations of all options relevant for code generation
+     * @return the key, or an error if an input could not be read
+     */
+    static hilti::Result<std::string> computeKey(const std::vector<hilti::rt::filesystem::path>& inputs,
+                                                 const std::vector<std::string>& options);
+
+    /**
+     * Looks up a cache entry and, if it's still valid, copies its `*.hlto`
+     * to a given output path.
+     *
+     * @param key cache key as computed by `computeKey()`
+     * @param output path to copy the cached `*.hlto` to
+     * @param index if given, path to copy the entry's analyzer index to; an entry stored without index then misses
+     * @return true if the entry was found, valid, and copied; false otherwise
+     */
+    bool lookup(const std::string& key, const hilti::rt::filesystem::path& output,
+                const std::optional<hilti::rt::filesystem::path>& index = {}) const;
+
+    /**
+     * Stores a freshly compiled `*.hlto` in the cache.
+     *
+     * @param key cache key as computed by `computeKey()`
+     * @param output path of the `*.hlto` to store
+     * @param dependencies all source files the compilation read
+     * @param index if given, path of the analyzer index written alongside the `*.hlto`, to store as well
+     * @return error if the entry could not be written
+     */
+    hilti::Result<hilti::Nothing> store(const std::string& key, const hilti::rt::filesystem::path& output,
+                                        const std::set<hilti::rt::filesystem::path>& dependencies,
+                                        const std::optional<hilti::rt::filesystem::path>& index = {}) const;
+
+private:
+    hilti::rt::filesystem::path _dir; /**< directory storing the cache entries */
+};
+
+} // namespace spicy::zeek
@@ -3,6 +3,7 @@
 #pragma once
 
 #include <memory>
+#include <set>
 #include <string>
 #include <unordered_map>
 #include <utility>
@@ -119,6 +120,12 @@ public:
     /** Returns the glue compiler in use by the driver. */
     const auto* glueCompiler() const { return _glue.get(); }
 
+    /**
+     * Returns the paths of all source files that compilation has read so
+     * far, including any modules imported indirectly.
+     */
+    const auto& sourceFiles() const { return _source_files; }
+
     /**
      * Parses some options command-line style *before* Zeek-side scripts have
      * been processed. Most of the option processing happens in
@@ -175,11 +182,12 @@ protected:
     /** Overidden from HILTI driver. */
     void hookFinishRuntime() override;
 
-    std::unique_ptr<GlueCompiler> _glue;            // glue compiler in use
-    std::unordered_map<hilti::ID, TypeInfo> _types; // map of Spicy type declarations encountered so far
-    std::vector<TypeInfo> _public_enums;            // tracks Spicy enum types declared public, for automatic export
-    bool _using_build_directory = false;            // true if we're running out of the plugin's build directory
-    bool _need_glue = true;                         // true if glue code has not yet been generated
+    std::unique_ptr<GlueCompiler> _glue;                 // glue compiler in use
+    std::unordered_map<hilti::ID, TypeInfo> _types;      // map of Spicy type declarations encountered so far
+    std::vector<TypeInfo> _public_enums;                 // tracks Spicy enum types declared public, for auto-export
+    std::set<hilti::rt::filesystem::path> _source_files; // source files read during compilation
+    bool _using_build_directory = false;                 // true if we're running out of the plugin's build directory
+    bool _need_glue = true;                              // true if glue code has not yet been generated
 };
 
 } // namespace spicy::zeek
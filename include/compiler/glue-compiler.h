@@ -3,6 +3,7 @@
 #pragma once
 
 #include <map>
+#include <ostream>
 #include <memory>
 #include <set>
 #include <string>
@@ -157,6 +158,17 @@ public:
      */
     bool compile();
 
+    /**
+     * Writes a plain-text index of all analyzers and events defined by the
+     * `*.evt` files loaded so far. Each line describes one item: either
+     * `protocol <name> <transport> <ports...>`, `file <name> <mime types...>`,
+     * `packet <name>`, or `event <name>`. Only information from the EVT
+     * files is included, not properties defined inside Spicy units.
+     *
+     * @param out stream to write the index to
+     */
+    void writeIndex(std::ostream& out) const;
+
     /** Returns all IDs that have been exported so far. */
     const auto& exportedIDs() const { return _exports; }
 
@@ -0,0 +1,27 @@
+// Copyright (c) 2020-2021 by the Zeek Project. See LICENSE for details.
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+namespace spicy::zeek::benchmarks {
+
+/**
+ * Runs the plugin's micro-benchmarks. These measure the runtime support
+ * layer in isolation: conversion of Spicy values into Zeek values, raising
+ * events, and tracking of in-flight files. They need to run inside a Zeek
+ * process that has finished initialization so that the Zeek-side types
+ * they convert into are available.
+ *
+ * This is available only if the plugin has been configured with
+ * `ZEEK_SPICY_ENABLE_BENCHMARKS`.
+ *
+ * @param args command line options to pass on to Google Benchmark, such as
+ * `--benchmark_filter=<regexp>` or `--benchmark_format=json` for
+ * machine-readable output
+ * @return false if the arguments could not be parsed
+ */
+bool run(const std::vector<std::string>& args);
+
+} // namespace spicy::zeek::benchmarks
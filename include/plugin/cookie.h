@@ -7,9 +7,13 @@
 
 #pragma once
 
+#include <algorithm>
+#include <chrono>
+#include <functional>
 #include <memory>
 #include <optional>
 #include <string>
+#include <unordered_map>
 #include <utility>
 #include <variant>
 #include <vector>
@@ -20,6 +24,129 @@
 
 namespace spicy::zeek::rt {
 
+/**
+ * Cumulative statistics for one Spicy analyzer, across all its instances.
+ * These are collected only if `Spicy::enable_analyzer_stats` is set.
+ */
+struct AnalyzerStats {
+    uint64_t time_ns = 0;    /**< wall-clock time spent processing input */
+    uint64_t bytes = 0;      /**< bytes of input fed into the analyzer */
+    uint64_t chunks = 0;     /**< rounds of processing, i.e., chunks or packets fed into the analyzer */
+    uint64_t events = 0;     /**< events raised */
+    uint64_t violations = 0; /**< analyzer violations reported due to parse errors */
+    uint64_t exceptions = 0; /**< other exceptions encountered during processing */
+    uint64_t memory = 0;     /**< approximate heap memory attributed to all instances, if tracked */
+};
+
+/**
+ * Runtime controls shared by all instances of one Spicy analyzer. Zeek
+ * processes all input on a single thread, so these don't need any
+ * synchronization.
+ */
+struct AnalyzerControls {
+    bool shed = false; /**< if true, instances stop parsing at their next round of input */
+};
+
+/**
+ * Helper recording one round of processing into an analyzer's statistics
+ * while in scope. No-op if statistics aren't collected.
+ */
+class StatsRecorder {
+public:
+    /**
+     * Constructor.
+     *
+     * @param stats statistics to record into; may be null to not record anything
+     * @param len number of bytes fed into this round of processing
+     */
+    StatsRecorder(AnalyzerStats* stats, uint64_t len) : _stats(stats) {
+        if ( ! _stats )
+            return;
+
+        ++_stats->chunks;
+        _stats->bytes += len;
+        _start = std::chrono::steady_clock::now();
+    }
+
+    ~StatsRecorder() {
+        if ( _stats )
+            _stats->time_ns +=
+                std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - _start).count();
+    }
+
+    StatsRecorder(const StatsRecorder&) = delete;
+    StatsRecorder& operator=(const StatsRecorder&) = delete;
+
+private:
+    AnalyzerStats* _stats;
+    std::chrono::steady_clock::time_point _start;
+};
+
+/**
+ * Tracks the heap memory attributed to one analyzer instance: the amount by
+ * which the heap has grown, net, while the instance was processing input.
+ *
+ * This is only an approximation, as Spicy doesn't expose how much memory
+ * parsing state actually holds. Besides buffered input and unit fields, it
+ * also counts anything else allocated during processing that gets released
+ * only later, such as events queued for Zeek, or the state of child
+ * analyzers. The amount therefore tends to grow over the instance's
+ * lifetime, and must not be used to make decisions about the instance.
+ */
+class MemoryAccount {
+public:
+    /**
+     * Returns the number of bytes currently allocated on the process' heap,
+     * as reported by the C library's allocator. Unlike the peak resident
+     * set size, this goes down again when memory gets freed. Returns zero
+     * if the allocator doesn't provide the information.
+     */
+    static uint64_t heapSize();
+
+    /** Returns true if `heapSize()` is supported on this platform. */
+    static bool haveHeapSize();
+
+    /**
+     * Attributes the change of heap size during one round of processing to
+     * the instance. The instance's amount never drops below zero, as memory
+     * allocated outside of its processing may get released during it.
+     *
+     * @param heap_before heap size when the round began
+     * @param heap_after heap size when the round ended
+     * @param total total across all instances of the analyzer, updated accordingly; may be null
+     */
+    void record(uint64_t heap_before, uint64_t heap_after, uint64_t* total) {
+        auto old = _current;
+
+        if ( heap_after >= heap_before )
+            _current += heap_after - heap_before;
+        else
+            _current -= std::min(_current, heap_before - heap_after);
+
+        if ( total )
+            *total = *total + _current - old;
+    }
+
+    /**
+     * Removes the instance's memory from its analyzer's total, for when the
+     * instance goes away.
+     *
+     * @param total total across all instances of the analyzer; may be null
+     */
+    void release(uint64_t* total) {
+        if ( total )
+            *total -= std::min(*total, _current);
+
+        _current = 0;
+    }
+
+    /** Returns the heap memory currently attributed to the instance. */
+    uint64_t current() const { return _current; }
+
+private:
+    uint64_t _current = 0;
+};
+
 namespace cookie {
 
 /** State representing analysis of one file. */
@@ -34,16 +161,24 @@ struct FileState {
  * state.
  *
  * Internally, this maintains a stack of state objects representing individual
- * files that are currently in-flight.
+ * files that are currently in-flight. Once the stack grows beyond
+ * `IndexThreshold` files, it also maintains a hash index mapping file IDs to
+ * stack positions, so that lookups don't need to scan the whole stack.
  */
 class FileStateStack {
 public:
+    /** Number of in-flight files beyond which lookups go through a hash index. */
+    static constexpr size_t IndexThreshold = 8;
+
     /**
      * Constructor.
      *
-     * @param analyzer_id unique ID string representing parent connection/file analyzer
+     * @param analyzer_id callback returning a unique ID string representing
+     * the parent connection/file analyzer; it's called only once the first
+     * file gets pushed, so that analyzers never seeing any files don't pay
+     * for building the string
      */
-    FileStateStack(std::string analyzer_id) : _analyzer_id(std::move(analyzer_id)) {}
+    FileStateStack(std::function<std::string()> analyzer_id) : _make_analyzer_id(std::move(analyzer_id)) {}
 
     /**
      * Begins analysis for a new file, pushing a new state object onto the
@@ -79,11 +214,29 @@ public:
     const FileState* find(const std::string& fid) const;
 
 private:
-    std::vector<FileState> _stack; // stack of files in flight
-    std::string _analyzer_id;      // unique ID string of parent analyzer, as passed into ctor
-    uint64_t _id_counter = 0;      // counter incremented for each file added to this stack
+    // Returns the stack position of a given file, or -1 if not found.
+    int64_t position(const std::string& fid) const;
+
+    std::vector<FileState> _stack;                  // stack of files in flight
+    std::unordered_map<std::string, size_t> _index; // fid to stack position; only used beyond IndexThreshold files
+    std::function<std::string()> _make_analyzer_id; // callback computing the ID string of parent analyzer
+    std::string _handle;                            // file handle buffer, starting with parent ID; set on first push
+    size_t _handle_prefix = 0;                      // length of the parent ID prefix inside `_handle`
+    uint64_t _id_counter = 0;                       // counter incremented for each file added to this stack
+};
+
+/** An event raised by Spicy code that has not yet been passed on to Zeek. */
+struct PendingEvent {
+    ::zeek::EventHandlerPtr handler; /**< handler to pass the event to */
+    ::zeek::Args args;               /**< arguments to pass to the handler */
 };
 
+/**
+ * Buffer of events raised during one round of processing, in the order they
+ * were raised. The buffer is reused across rounds to avoid reallocations.
+ */
+using EventBuffer = std::vector<PendingEvent>;
+
 /** State on the current protocol analyzer. */
 struct ProtocolAnalyzer {
     ::zeek::analyzer::Analyzer* analyzer = nullptr; /**< current analyzer */
@@ -92,14 +245,20 @@ struct ProtocolAnalyzer {
     FileStateStack fstate_orig;                     /**< file analysis state for originator side */
     FileStateStack fstate_resp;                     /**< file analysis state for responder side */
     std::shared_ptr<::zeek::packet_analysis::TCP::TCPSessionAdapter>
-        fake_tcp; /**< fake TPC analyzer created internally */
+        fake_tcp;                   /**< fake TPC analyzer created internally */
+    EventBuffer pending_events;     /**< events buffered if `Spicy::batch_events` is set */
+    ::zeek::ValPtr conn_val;        /**< cached $conn value for the current round of processing */
+    AnalyzerStats* stats = nullptr; /**< statistics to record into, if collected */
 };
 
 /** State on the current file analyzer. */
 struct FileAnalyzer {
     ::zeek::file_analysis::Analyzer* analyzer = nullptr; /**< current analyzer */
-    uint64_t depth = 0;    /**< recursive depth of file analysis (Spicy-side file analysis only) */
-    FileStateStack fstate; /**< file analysis state for nested files */
+    uint64_t depth = 0;             /**< recursive depth of file analysis (Spicy-side file analysis only) */
+    FileStateStack fstate;          /**< file analysis state for nested files */
+    EventBuffer pending_events;     /**< events buffered if `Spicy::batch_events` is set */
+    ::zeek::ValPtr file_val;        /**< cached $file value for the current round of processing */
+    AnalyzerStats* stats = nullptr; /**< statistics to record into, if collected */
 };
 
 /** State on the current file analyzer. */
@@ -108,6 +267,7 @@ struct PacketAnalyzer {
     ::zeek::Packet* packet = nullptr;                      /**< current packet */
     ::zeek::ValPtr packet_val = nullptr;                   /**< cached "raw_pkt_hdr" val for packet */
     std::optional<uint32_t> next_analyzer;
+    AnalyzerStats* stats = nullptr;                        /**< statistics to record into, if collected */
 };
 
 } // namespace cookie
@@ -81,7 +81,14 @@ protected:
     void DebugMsg(const std::string& msg) { _state.DebugMsg(msg); }
 
 private:
+    // Records the heap memory used during one round of processing, and
+    // stops parsing if the heap exceeds its limit. Returns false if so.
+    bool checkMemory(uint64_t heap_before);
+
     FileState _state;
+    const AnalyzerControls* _controls = nullptr; /**< Runtime controls for our analyzer, set with the parser. */
+    MemoryAccount _memory;                       /**< Heap memory attributed to this instance. */
+    uint64_t* _memory_total = nullptr; /**< Memory attributed to all instances of our analyzer, if tracked. */
 };
 
 } // namespace spicy::zeek::rt
@@ -12,12 +12,17 @@
 #include <hilti/rt/library.h>
 #include <hilti/rt/types/port.h>
 
+#include <zeek-spicy/plugin/cookie.h>
 #include <zeek-spicy/plugin/zeek-compat.h>
 
 namespace spicy::rt {
 struct Parser;
 }
 
+namespace spicy::zeek::rt {
+struct EventPlan;
+}
+
 namespace plugin::Zeek_Spicy {
 
 /*
@@ -120,6 +125,17 @@ public:
      */
     void registerEvent(const std::string& name);
 
+    /**
+     * Runtime method to take ownership of the plan for raising a
+     * Spicy-generated event. This is called at initialization time by
+     * generated Spicy code for each event defined in an EVT file, once the
+     * Zeek-side event types are final.
+     *
+     * @param plan plan to store
+     * @return pointer to the stored plan, which will remain valid for the life-time of the process
+     */
+    const spicy::zeek::rt::EventPlan* registerEventPlan(std::unique_ptr<spicy::zeek::rt::EventPlan> plan);
+
     /**
      * Runtime method to retrieve the Spicy parser for a given Zeek protocol analyzer tag.
      *
@@ -148,6 +164,63 @@ public:
      */
     const spicy::rt::Parser* parserForPacketAnalyzer(const ::zeek::Tag& tag);
 
+    /**
+     * Runtime method to retrieve the statistics for a given Zeek protocol
+     * analyzer tag.
+     *
+     * @param tag requested protocol analyzer
+     * @return statistics, or null if we don't have an analyzer for this tag. The pointer will remain valid for the
+     * life-time of the process.
+     */
+    spicy::zeek::rt::AnalyzerStats* statsForProtocolAnalyzer(const ::zeek::Tag& tag);
+
+    /**
+     * Runtime method to retrieve the statistics for a given Zeek file
+     * analyzer tag.
+     *
+     * @param tag requested file analyzer
+     * @return statistics, or null if we don't have an analyzer for this tag. The pointer will remain valid for the
+     * life-time of the process.
+     */
+    spicy::zeek::rt::AnalyzerStats* statsForFileAnalyzer(const ::zeek::Tag& tag);
+
+    /**
+     * Runtime method to retrieve the statistics for a given Zeek packet
+     * analyzer tag.
+     *
+     * @param tag requested packet analyzer
+     * @return statistics, or null if we don't have an analyzer for this tag. The pointer will remain valid for the
+     * life-time of the process.
+     */
+    spicy::zeek::rt::AnalyzerStats* statsForPacketAnalyzer(const ::zeek::Tag& tag);
+
+    /**
+     * Runtime method to retrieve the runtime controls for a given Zeek
+     * protocol analyzer tag.
+     *
+     * @param tag requested protocol analyzer
+     * @return controls, or null if we don't have an analyzer for this tag. The pointer will remain valid for the
+     * life-time of the process.
+     */
+    const spicy::zeek::rt::AnalyzerControls* controlsForProtocolAnalyzer(const ::zeek::Tag& tag);
+
+    /**
+     * Runtime method to retrieve the runtime controls for a given Zeek file
+     * analyzer tag.
+     *
+     * @param tag requested file analyzer
+     * @return controls, or null if we don't have an analyzer for this tag. The pointer will remain valid for the
+     * life-time of the process.
+     */
+    const spicy::zeek::rt::AnalyzerControls* controlsForFileAnalyzer(const ::zeek::Tag& tag);
+
+    /**
+     * Returns the statistics collected for all Spicy analyzers, along with
+     * the analyzers' names. Statistics are collected only if
+     * `Spicy::enable_analyzer_stats` is set.
+     */
+    std::vector<std::pair<std::string, spicy::zeek::rt::AnalyzerStats>> analyzerStats() const;
+
     /**
      * Runtime method to retrieve the analyzer tag that should be passed to
      * script-land when talking about a protocol analyzer. This is normally
@@ -228,6 +301,19 @@ public:
      */
     bool toggleAnalyzer(::zeek::EnumVal* tag, bool enable);
 
+    /**
+     * Starts or stops shedding load for a protocol or file analyzer. While
+     * shedding, all instances of the analyzer, including those already in
+     * flight, skip any further input. Different from disabling an analyzer,
+     * this doesn't bring back a standard analyzer that the Spicy one
+     * replaces.
+     *
+     * @param name name of the analyzer, as used by `analyzerStats()`
+     * @param shed true to start shedding, false to stop
+     * @return false if there's no such protocol or file analyzer
+     */
+    bool shedAnalyzer(const std::string& name, bool shed);
+
 protected:
     // Overriding method from Zeek's plugin API.
     zeek::plugin::Configuration Configure() override;
@@ -286,6 +372,10 @@ private:
         const spicy::rt::Parser* parser_resp;
         ::zeek::Tag replaces;
 
+        // Collected at runtime.
+        spicy::zeek::rt::AnalyzerStats stats;
+        spicy::zeek::rt::AnalyzerControls controls;
+
         bool operator==(const ProtocolAnalyzerInfo& other) const {
             return name_analyzer == other.name_analyzer && name_parser_orig == other.name_parser_orig &&
                    name_parser_resp == other.name_parser_resp && name_replaces == other.name_replaces &&
@@ -311,6 +401,10 @@ private:
         const spicy::rt::Parser* parser;
         ::zeek::Tag replaces;
 
+        // Collected at runtime.
+        spicy::zeek::rt::AnalyzerStats stats;
+        spicy::zeek::rt::AnalyzerControls controls;
+
         bool operator==(const FileAnalyzerInfo& other) const {
             return name_analyzer == other.name_analyzer && name_parser == other.name_parser &&
                    name_replaces == other.name_replaces && mime_types == other.mime_types &&
@@ -335,6 +429,9 @@ private:
         const spicy::rt::Parser* parser;
         ::zeek::Tag replaces;
 
+        // Collected at runtime.
+        spicy::zeek::rt::AnalyzerStats stats;
+
         // Compares only the provided attributes, as that's what defines us.
         bool operator==(const PacketAnalyzerInfo& other) const {
             return name_analyzer == other.name_analyzer && name_parser == other.name_parser &&
@@ -352,6 +449,7 @@ private:
     std::unordered_map<std::string, hilti::rt::Library> _libraries;
     std::set<std::string> _locations;
     std::unordered_map<std::string, ::zeek::detail::IDPtr> _events;
+    std::vector<std::unique_ptr<spicy::zeek::rt::EventPlan>> _event_plans;
 
     // Mapping of component names to tag types. We use this to ensure analyzer uniqueness.
     std::unordered_map<std::string, int32_t> _analyzer_name_to_tag_type;
@@ -105,9 +105,25 @@ protected:
     void DebugMsg(bool is_orig, const std::string& msg);
 
 private:
+    // Looks up the parsers, statistics, and controls for our analyzer's tag
+    // once, so that processing doesn't need to go through the plugin anymore.
+    void resolveParsers();
+
+    // Records the heap memory used during one round of processing on an
+    // endpoint, and stops parsing if the heap exceeds its limit.
+    void checkMemory(EndpointState* endp, uint64_t heap_before);
+
     EndpointState _originator; /**< Originator-side state. */
     EndpointState _responder;  /**< Responder-side state. */
     std::optional<spicy::rt::UnitContext> _context;
+
+    bool _resolved = false;                                       /**< True once resolveParsers() has run. */
+    const spicy::rt::Parser* _parser_orig = nullptr;              /**< Parser for originator side, if any. */
+    const spicy::rt::Parser* _parser_resp = nullptr;              /**< Parser for responder side, if any. */
+    spicy::zeek::rt::AnalyzerStats* _stats = nullptr;             /**< Statistics to record into, if collected. */
+    const spicy::zeek::rt::AnalyzerControls* _controls = nullptr; /**< Runtime controls for our analyzer. */
+    spicy::zeek::rt::MemoryAccount _memory;                       /**< Heap memory attributed to this instance. */
+    uint64_t* _memory_total = nullptr; /**< Memory attributed to all instances of our analyzer, if tracked. */
 };
 
 /**
@@ -6,13 +6,17 @@
 
 #pragma once
 
+#include <cinttypes>
 #include <limits>
 #include <memory>
 #include <optional>
 #include <string>
 #include <tuple>
+#include <unordered_map>
 #include <utility>
+#include <vector>
 
+#include <hilti/rt/context.h>
 #include <hilti/rt/deferred-expression.h>
 #include <hilti/rt/exception.h>
 #include <hilti/rt/fmt.h>
@@ -157,8 +161,49 @@ extern ::zeek::TypePtr create_record_type(const std::string& ns, const std::stri
 extern ::zeek::TypePtr create_table_type(::zeek::TypePtr key, std::optional<::zeek::TypePtr> value);
 extern ::zeek::TypePtr create_vector_type(const ::zeek::TypePtr& elem);
 
+/**
+ * Zeek-side information about a Spicy-generated event, resolved once at
+ * initialization time so that raising the event does not need to look it up
+ * again.
+ */
+struct EventPlan {
+    ::zeek::EventHandlerPtr handler;        /**< Zeek-side handler for the event */
+    std::vector<::zeek::TypePtr> arg_types; /**< Zeek-side types of the event's parameters */
+    uint64_t num_args = 0;                  /**< number of arguments the EVT definition passes to the event */
+    bool valid = false;                     /**< true if the EVT arguments match the Zeek-side prototype */
+    std::string location;                   /**< location of the EVT definition, for error reporting */
+    std::vector<std::string> arg_locations; /**< locations of the EVT argument expressions, for error reporting */
+};
+
+/**
+ * Pointer to an event plan. Plans are owned by the plugin and remain valid
+ * for the life-time of the process.
+ */
+using EventPlanPtr = const EventPlan*;
+
 /** Returns true if an event has at least one handler defined. */
-inline hilti::rt::Bool have_handler(const ::zeek::EventHandlerPtr& handler) { return static_cast<bool>(handler); }
+inline hilti::rt::Bool have_handler(EventPlanPtr plan) { return static_cast<bool>(plan->handler); }
+
+/**
+ * Throws if the event's arguments do not match what the Zeek-side event
+ * expects. This is separate from `have_handler()` so that the latter can run
+ * before evaluating an event's condition, while a mismatch gets reported
+ * only if the event would actually be raised.
+ */
+inline void check_event_args(EventPlanPtr plan) {
+    if ( ! plan->valid ) {
+        auto expected = static_cast<uint64_t>(plan->arg_types.size());
+
+        if ( plan->num_args > expected )
+            throw TypeMismatch(hilti::rt::fmt("more parameters given than the %" PRIu64 " that the Zeek event expects",
+                                              expected),
+                               plan->location);
+        else
+            throw TypeMismatch(hilti::rt::fmt("expected %" PRIu64 " parameters, but got %" PRIu64, expected,
+                                              plan->num_args),
+                               plan->location);
+    }
+}
 
 /**
  * Creates a new event handler under the given name.
@@ -171,16 +216,103 @@ void install_handler(const std::string& name);
  */
 ::zeek::EventHandlerPtr internal_handler(const std::string& name);
 
-/** Raises a Zeek event, given the handler and arguments. */
-void raise_event(const ::zeek::EventHandlerPtr& handler, const hilti::rt::Vector<::zeek::ValPtr>& args,
-                 const std::string& location);
+/**
+ * Creates the plan for raising an event. The event's handler must have been
+ * installed before through `install_handler()`, and the Zeek-side event type
+ * must be final, meaning that this must be called only once script
+ * processing has finished.
+ *
+ * @param name name of the event
+ * @param arg_locations locations of the argument expressions the EVT
+ * definition passes to the event, one per argument; for error reporting
+ * @param location location of the EVT definition, for error reporting
+ * @return plan for the event, which remains valid for the life-time of the process
+ */
+EventPlanPtr event_plan(const std::string& name, const hilti::rt::Vector<std::string>& arg_locations,
+                        const std::string& location);
+
+/**
+ * Returns an empty argument list for raising an event, with space reserved
+ * for all of the event's arguments.
+ */
+inline ::zeek::Args event_args(EventPlanPtr plan) {
+    ::zeek::Args args;
+    args.reserve(plan->num_args);
+    return args;
+}
+
+/**
+ * Appends a converted value to an event's argument list. Throws if the value
+ * is null.
+ */
+inline void event_arg_add(::zeek::Args& args, ::zeek::ValPtr v, const std::string& location) {
+    if ( ! v )
+        // Shouldn't happen here, but we have to be sure that we don't pass
+        // nulls on to Zeek.
+        throw InvalidValue("null value encountered after conversion", location);
+
+    args.emplace_back(std::move(v));
+}
 
 /**
- * Returns the Zeek type of an event's i'th argument. The result's ref count
- * is not increased.
+ * Raises a Zeek event, given its plan and arguments. The caller must have
+ * checked through `have_handler()` and `check_event_args()` that the event
+ * can be raised, and built the arguments through
+ * `event_args()`/`event_arg_add()`. If
+ * `Spicy::batch_events` is set, the event is buffered with the current
+ * analyzer until its current round of processing finishes.
  */
-::zeek::TypePtr event_arg_type(const ::zeek::EventHandlerPtr& handler, const hilti::rt::integer::safe<uint64_t>& idx,
-                               const std::string& location);
+void raise_event(EventPlanPtr plan, ::zeek::Args args);
+
+/**
+ * Passes all events buffered for the analyzer associated with a cookie on to
+ * Zeek's event manager, in the order they were raised. No-op if there aren't
+ * any.
+ */
+void flush_events(Cookie* cookie);
+
+/**
+ * Helper flushing the current cookie's buffered events when going out of
+ * scope. Meant to be instantiated for each round of processing that may
+ * raise events, right after setting the cookie, so that it flushes before
+ * the cookie gets reset (including when unwinding from an exception).
+ */
+class EventFlusher {
+public:
+    EventFlusher() = default;
+    ~EventFlusher() { flush_events(static_cast<Cookie*>(hilti::rt::context::cookie())); }
+
+    EventFlusher(const EventFlusher&) = delete;
+    EventFlusher& operator=(const EventFlusher&) = delete;
+};
+
+/**
+ * Returns the Zeek type of an event's i'th argument. The index must be
+ * valid, which `check_event_args()` ensures. The result's ref count is not
+ * increased.
+ */
+inline const ::zeek::TypePtr& event_arg_type(EventPlanPtr plan, const hilti::rt::integer::safe<uint64_t>& idx) {
+    return plan->arg_types[idx.Ref()];
+}
+
+/**
+ * Returns the location of an event's i'th argument expression inside the
+ * EVT file, for passing on to functions that may report errors. This
+ * returns a reference to the string stored with the plan, so it doesn't
+ * construct a new string on every event.
+ */
+inline const std::string& event_arg_location(EventPlanPtr plan, const hilti::rt::integer::safe<uint64_t>& idx) {
+    return plan->arg_locations[idx.Ref()];
+}
+
+/** Statistics on reusing cached `$conn`/`$file` values, for debugging. */
+struct ValueCacheStats {
+    uint64_t hits = 0;   /**< number of times a cached value was reused */
+    uint64_t misses = 0; /**< number of times a value had to be fetched from Zeek */
+};
+
+/** Global statistics on the `$conn`/`$file` value caches. */
+extern ValueCacheStats value_cache_stats;
 
 /**
  * Retrieves the connection ID for the currently processed Zeek connection.
@@ -326,6 +458,12 @@ std::string fuid();
  */
 void terminate_session();
 
+/**
+ * Tells Zeek to stop sending any further input data to the current
+ * analyzer.
+ */
+void skip_input();
+
 /**
  * Signals the expected size of a file to Zeek's file analysis.
  *
@@ -352,6 +490,29 @@ void file_data_in(const hilti::rt::Bytes& data, const std::optional<std::string>
 void file_data_in_at_offset(const hilti::rt::Bytes& data, const hilti::rt::integer::safe<uint64_t>& offset,
                             const std::optional<std::string>& fid = {});
 
+/**
+ * Passes file content on to Zeek's file analysis, taking it directly from a
+ * view into a stream. Each of the stream's chunks covered by the view gets
+ * passed on as-is, without first copying it into a separate buffer.
+ *
+ * @param data view covering the next chunk of data
+ * @param fid ID of the file to operate on; if unset, the most recently begun file is used
+ */
+void file_data_in_view(const hilti::rt::stream::View& data, const std::optional<std::string>& fid = {});
+
+/**
+ * Passes file content at a specific offset on to Zeek's file analysis,
+ * taking it directly from a view into a stream. Each of the stream's chunks
+ * covered by the view gets passed on as-is, without first copying it into a
+ * separate buffer.
+ *
+ * @param data view covering the next chunk of data
+ * @param offset file offset of the data geing passed in
+ * @param fid ID of the file to operate on; if unset, the most recently begun file is used
+ */
+void file_data_in_view_at_offset(const hilti::rt::stream::View& data, const hilti::rt::integer::safe<uint64_t>& offset,
+                                 const std::optional<std::string>& fid = {});
+
 /**
  * Signals a gap in a file to Zeek's file analysis.
  *
@@ -375,38 +536,118 @@ void forward_packet(const hilti::rt::integer::safe<uint32_t>& identifier);
 /** Gets the network time from Zeek. */
 hilti::rt::Time network_time();
 
+namespace detail {
+
+/**
+ * Conversion table for turning a Spicy-side struct or tuple into a specific
+ * Zeek record type. Computed once, on first use.
+ */
+struct RecordConversion {
+    void init(const ::zeek::TypePtr& target) {
+        rtype = ::zeek::cast_intrusive<::zeek::RecordType>(target);
+        can_be_unset.resize(rtype->NumFields());
+
+        for ( int i = 0; i < rtype->NumFields(); i++ ) {
+            const auto& attrs = rtype->FieldDecl(i)->attrs;
+            can_be_unset[i] =
+                attrs && (attrs->Find(::zeek::detail::ATTR_DEFAULT) || attrs->Find(::zeek::detail::ATTR_OPTIONAL));
+        }
+    }
+
+    ::zeek::RecordTypePtr rtype;    /**< record type converted into; also keeps the cache's key alive */
+    std::vector<bool> can_be_unset; /**< true for each field that is &optional or has a &default */
+    bool validated = false;         /**< true once field names have been confirmed to match */
+};
+
+/**
+ * Conversion table for turning a Spicy-side enum into a specific Zeek enum
+ * type. Enum values are pre-fetched on first use of each label.
+ */
+struct EnumConversion {
+    void init(const ::zeek::TypePtr& target) { etype = target; }
+
+    /** Returns the Zeek-side value for an enum value, caching it. */
+    const ::zeek::EnumValPtr& get(zeek_int_t bt) {
+        if ( bt < 0 || bt >= MaxCachedValue )
+            return (undef = etype->AsEnumType()->GetEnumVal(bt));
+
+        auto idx = static_cast<size_t>(bt);
+        if ( idx >= vals.size() )
+            vals.resize(idx + 1);
+
+        if ( ! vals[idx] )
+            vals[idx] = etype->AsEnumType()->GetEnumVal(bt);
+
+        return vals[idx];
+    }
+
+    static constexpr zeek_int_t MaxCachedValue = 1024; /**< values beyond this aren't cached */
+
+    ::zeek::TypePtr etype;                /**< enum type converted into; also keeps the cache's key alive */
+    std::vector<::zeek::EnumValPtr> vals; /**< values indexed by their integer, unset if not yet fetched */
+    ::zeek::EnumValPtr undef;             /**< most recent value outside of the cached range */
+};
+
+/**
+ * Returns the conversion table for a Spicy-side type `T` and a Zeek-side
+ * target type, creating it on first use. Zeek types don't change anymore
+ * once script processing has finished, so tables never need invalidating.
+ */
+template<typename T, typename Table>
+Table& conversion_table(const ::zeek::TypePtr& target) {
+    static std::unordered_map<const ::zeek::Type*, Table> tables;
+    static const ::zeek::Type* last_type = nullptr;
+    static Table* last_table = nullptr;
+
+    // Most types will always be converted into the same Zeek type.
+    if ( target.get() == last_type )
+        return *last_table;
+
+    auto [i, inserted] = tables.try_emplace(target.get());
+    if ( inserted )
+        i->second.init(target);
+
+    last_type = target.get();
+    last_table = &i->second;
+    return i->second;
+}
+
+} // namespace detail
+
 // Forward-declare to_val() functions.
 template<typename T, typename std::enable_if_t<hilti::rt::is_tuple<T>::value>* = nullptr>
-::zeek::ValPtr to_val(const T& t, ::zeek::TypePtr target, const std::string& location);
+::zeek::ValPtr to_val(const T& t, const ::zeek::TypePtr& target, const std::string& location);
 template<typename T, typename std::enable_if_t<std::is_base_of<::hilti::rt::trait::isStruct, T>::value>* = nullptr>
-::zeek::ValPtr to_val(const T& t, ::zeek::TypePtr target, const std::string& location);
+::zeek::ValPtr to_val(const T& t, const ::zeek::TypePtr& target, const std::string& location);
 template<typename T, typename std::enable_if_t<std::is_enum<typename T::Value>::value>* = nullptr>
-::zeek::ValPtr to_val(const T& t, ::zeek::TypePtr target, const std::string& location);
+::zeek::ValPtr to_val(const T& t, const ::zeek::TypePtr& target, const std::string& location);
 template<typename T, typename std::enable_if_t<std::is_enum<T>::value>* = nullptr>
-::zeek::ValPtr to_val(const T& t, ::zeek::TypePtr target, const std::string& location);
+::zeek::ValPtr to_val(const T& t, const ::zeek::TypePtr& target, const std::string& location);
 template<typename K, typename V>
-::zeek::ValPtr to_val(const hilti::rt::Map<K, V>& s, ::zeek::TypePtr target, const std::string& location);
+::zeek::ValPtr to_val(const hilti::rt::Map<K, V>& s, const ::zeek::TypePtr& target, const std::string& location);
 template<typename T>
-::zeek::ValPtr to_val(const hilti::rt::Set<T>& s, ::zeek::TypePtr target, const std::string& location);
+::zeek::ValPtr to_val(const hilti::rt::Set<T>& s, const ::zeek::TypePtr& target, const std::string& location);
 template<typename T>
-::zeek::ValPtr to_val(const hilti::rt::Vector<T>& v, ::zeek::TypePtr target, const std::string& location);
+::zeek::ValPtr to_val(const hilti::rt::Vector<T>& v, const ::zeek::TypePtr& target, const std::string& location);
 template<typename T>
-::zeek::ValPtr to_val(const std::optional<T>& t, ::zeek::TypePtr target, const std::string& location);
+::zeek::ValPtr to_val(const std::optional<T>& t, const ::zeek::TypePtr& target, const std::string& location);
 template<typename T>
-::zeek::ValPtr to_val(const hilti::rt::DeferredExpression<T>& t, ::zeek::TypePtr target, const std::string& location);
+::zeek::ValPtr to_val(const hilti::rt::DeferredExpression<T>& t, const ::zeek::TypePtr& target,
+                      const std::string& location);
 template<typename T>
-::zeek::ValPtr to_val(hilti::rt::integer::safe<T> i, ::zeek::TypePtr target, const std::string& location);
+::zeek::ValPtr to_val(hilti::rt::integer::safe<T> i, const ::zeek::TypePtr& target, const std::string& location);
 template<typename T>
-::zeek::ValPtr to_val(const hilti::rt::ValueReference<T>& t, ::zeek::TypePtr target, const std::string& location);
-
-inline ::zeek::ValPtr to_val(const hilti::rt::Bool& b, ::zeek::TypePtr target, const std::string& location);
-inline ::zeek::ValPtr to_val(const hilti::rt::Address& d, ::zeek::TypePtr target, const std::string& location);
-inline ::zeek::ValPtr to_val(const hilti::rt::Bytes& b, ::zeek::TypePtr target, const std::string& location);
-inline ::zeek::ValPtr to_val(const hilti::rt::Interval& t, ::zeek::TypePtr target, const std::string& location);
-inline ::zeek::ValPtr to_val(const hilti::rt::Port& d, ::zeek::TypePtr target, const std::string& location);
-inline ::zeek::ValPtr to_val(const hilti::rt::Time& t, ::zeek::TypePtr target, const std::string& location);
-inline ::zeek::ValPtr to_val(const std::string& s, ::zeek::TypePtr target, const std::string& location);
-inline ::zeek::ValPtr to_val(double r, ::zeek::TypePtr target, const std::string& location);
+::zeek::ValPtr to_val(const hilti::rt::ValueReference<T>& t, const ::zeek::TypePtr& target,
+                      const std::string& location);
+
+inline ::zeek::ValPtr to_val(const hilti::rt::Bool& b, const ::zeek::TypePtr& target, const std::string& location);
+inline ::zeek::ValPtr to_val(const hilti::rt::Address& d, const ::zeek::TypePtr& target, const std::string& location);
+inline ::zeek::ValPtr to_val(const hilti::rt::Bytes& b, const ::zeek::TypePtr& target, const std::string& location);
+inline ::zeek::ValPtr to_val(const hilti::rt::Interval& t, const ::zeek::TypePtr& target, const std::string& location);
+inline ::zeek::ValPtr to_val(const hilti::rt::Port& d, const ::zeek::TypePtr& target, const std::string& location);
+inline ::zeek::ValPtr to_val(const hilti::rt::Time& t, const ::zeek::TypePtr& target, const std::string& location);
+inline ::zeek::ValPtr to_val(const std::string& s, const ::zeek::TypePtr& target, const std::string& location);
+inline ::zeek::ValPtr to_val(double r, const ::zeek::TypePtr& target, const std::string& location);
 
 /**
  * Converts a Spicy-side optional value to a Zeek value. This assumes the
@@ -414,7 +655,7 @@ inline ::zeek::ValPtr to_val(double r, ::zeek::TypePtr target, const std::string
  * returned with ref count +1.
  */
 template<typename T>
-inline ::zeek::ValPtr to_val(const std::optional<T>& t, ::zeek::TypePtr target, const std::string& location) {
+inline ::zeek::ValPtr to_val(const std::optional<T>& t, const ::zeek::TypePtr& target, const std::string& location) {
     if ( t.has_value() )
         return to_val(hilti::rt::optional::value(t, location.data()), target, location);
 
@@ -428,7 +669,7 @@ inline ::zeek::ValPtr to_val(const std::optional<T>& t, ::zeek::TypePtr target,
  * picks up on).
  */
 template<typename T>
-inline ::zeek::ValPtr to_val(const hilti::rt::DeferredExpression<T>& t, ::zeek::TypePtr target,
+inline ::zeek::ValPtr to_val(const hilti::rt::DeferredExpression<T>& t, const ::zeek::TypePtr& target,
                              const std::string& location) {
     try {
         return to_val(t(), target, location);
@@ -441,22 +682,26 @@ inline ::zeek::ValPtr to_val(const hilti::rt::DeferredExpression<T>& t, ::zeek::
  * Converts a Spicy-side string to a Zeek value. The result is returned with
  * ref count +1.
  */
-inline ::zeek::ValPtr to_val(const std::string& s, ::zeek::TypePtr target, const std::string& location) {
+inline ::zeek::ValPtr to_val(const std::string& s, const ::zeek::TypePtr& target, const std::string& location) {
     if ( target->Tag() != ::zeek::TYPE_STRING )
         throw TypeMismatch("string", target, location);
 
-    return ::zeek::make_intrusive<::zeek::StringVal>(s);
+    return ::zeek::make_intrusive<::zeek::StringVal>(static_cast<int>(s.size()), s.data());
 }
 
 /**
  * Converts a Spicy-side bytes instance to a Zeek value. The result is returned with
  * ref count +1.
+ *
+ * The data is copied exactly once, straight into the new value's buffer.
+ * (Zeek can only adopt buffers it allocated itself, so there's no way to
+ * hand over the bytes' storage even when converting a temporary.)
  */
-inline ::zeek::ValPtr to_val(const hilti::rt::Bytes& b, ::zeek::TypePtr target, const std::string& location) {
+inline ::zeek::ValPtr to_val(const hilti::rt::Bytes& b, const ::zeek::TypePtr& target, const std::string& location) {
     if ( target->Tag() != ::zeek::TYPE_STRING )
         throw TypeMismatch("string", target, location);
 
-    return ::zeek::make_intrusive<::zeek::StringVal>(b.str());
+    return ::zeek::make_intrusive<::zeek::StringVal>(static_cast<int>(b.size()), b.data());
 }
 
 /**
@@ -464,7 +709,8 @@ inline ::zeek::ValPtr to_val(const hilti::rt::Bytes& b, ::zeek::TypePtr target,
  * returned with ref count +1.
  */
 template<typename T>
-inline ::zeek::ValPtr to_val(hilti::rt::integer::safe<T> i, ::zeek::TypePtr target, const std::string& location) {
+inline ::zeek::ValPtr to_val(hilti::rt::integer::safe<T> i, const ::zeek::TypePtr& target,
+                             const std::string& location) {
     ::zeek::ValPtr v = nullptr;
     if constexpr ( std::is_unsigned<T>::value ) {
         if ( target->Tag() == ::zeek::TYPE_COUNT )
@@ -491,7 +737,8 @@ inline ::zeek::ValPtr to_val(hilti::rt::integer::safe<T> i, ::zeek::TypePtr targ
 }
 
 template<typename T>
-::zeek::ValPtr to_val(const hilti::rt::ValueReference<T>& t, ::zeek::TypePtr target, const std::string& location) {
+::zeek::ValPtr to_val(const hilti::rt::ValueReference<T>& t, const ::zeek::TypePtr& target,
+                      const std::string& location) {
     if ( auto* x = t.get() )
         return to_val(*x, target, location);
 
@@ -502,7 +749,7 @@ template<typename T>
  * Converts a Spicy-side signed bool to a Zeek value. The result is
  * returned with ref count +1.
  */
-inline ::zeek::ValPtr to_val(const hilti::rt::Bool& b, ::zeek::TypePtr target, const std::string& location) {
+inline ::zeek::ValPtr to_val(const hilti::rt::Bool& b, const ::zeek::TypePtr& target, const std::string& location) {
     if ( target->Tag() != ::zeek::TYPE_BOOL )
         throw TypeMismatch("bool", target, location);
 
@@ -513,7 +760,7 @@ inline ::zeek::ValPtr to_val(const hilti::rt::Bool& b, ::zeek::TypePtr target, c
  * Converts a Spicy-side real to a Zeek value. The result is returned with
  * ref count +1.
  */
-inline ::zeek::ValPtr to_val(double r, ::zeek::TypePtr target, const std::string& location) {
+inline ::zeek::ValPtr to_val(double r, const ::zeek::TypePtr& target, const std::string& location) {
     if ( target->Tag() != ::zeek::TYPE_DOUBLE )
         throw TypeMismatch("double", target, location);
 
@@ -524,7 +771,7 @@ inline ::zeek::ValPtr to_val(double r, ::zeek::TypePtr target, const std::string
  * Converts a Spicy-side address to a Zeek value. The result is returned with
  * ref count +1.
  */
-inline ::zeek::ValPtr to_val(const hilti::rt::Address& d, ::zeek::TypePtr target, const std::string& location) {
+inline ::zeek::ValPtr to_val(const hilti::rt::Address& d, const ::zeek::TypePtr& target, const std::string& location) {
     if ( target->Tag() != ::zeek::TYPE_ADDR )
         throw TypeMismatch("addr", target, location);
 
@@ -541,7 +788,7 @@ inline ::zeek::ValPtr to_val(const hilti::rt::Address& d, ::zeek::TypePtr target
  * Converts a Spicy-side address to a Zeek value. The result is returned with
  * ref count +1.
  */
-inline ::zeek::ValPtr to_val(const hilti::rt::Port& p, ::zeek::TypePtr target, const std::string& location) {
+inline ::zeek::ValPtr to_val(const hilti::rt::Port& p, const ::zeek::TypePtr& target, const std::string& location) {
     if ( target->Tag() != ::zeek::TYPE_PORT )
         throw TypeMismatch("port", target, location);
 
@@ -566,7 +813,7 @@ inline ::zeek::ValPtr to_val(const hilti::rt::Port& p, ::zeek::TypePtr target, c
  * Converts a Spicy-side time to a Zeek value. The result is returned with
  * ref count +1.
  */
-inline ::zeek::ValPtr to_val(const hilti::rt::Interval& i, ::zeek::TypePtr target, const std::string& location) {
+inline ::zeek::ValPtr to_val(const hilti::rt::Interval& i, const ::zeek::TypePtr& target, const std::string& location) {
     if ( target->Tag() != ::zeek::TYPE_INTERVAL )
         throw TypeMismatch("interval", target, location);
 
@@ -577,39 +824,188 @@ inline ::zeek::ValPtr to_val(const hilti::rt::Interval& i, ::zeek::TypePtr targe
  * Converts a Spicy-side time to a Zeek value. The result is returned with
  * ref count +1.
  */
-inline ::zeek::ValPtr to_val(const hilti::rt::Time& t, ::zeek::TypePtr target, const std::string& location) {
+inline ::zeek::ValPtr to_val(const hilti::rt::Time& t, const ::zeek::TypePtr& target, const std::string& location) {
     if ( target->Tag() != ::zeek::TYPE_TIME )
         throw TypeMismatch("time", target, location);
 
     return ::zeek::make_intrusive<::zeek::TimeVal>(t.seconds());
 }
 
+namespace detail {
+
+/** Trait for vector element types that `to_val()` converts in bulk. */
+template<typename T>
+struct is_bulk_convertible
+    : std::integral_constant<bool, std::is_same<T, double>::value || std::is_same<T, hilti::rt::Bool>::value> {};
+
+template<typename T>
+struct is_bulk_convertible<hilti::rt::integer::safe<T>> : std::true_type {};
+
+// Pre-sizes a Zeek vector, then assigns it converted elements of a
+// Spicy-side vector.
+template<typename T, typename F>
+inline void vector_fill(::zeek::VectorVal* zv, const hilti::rt::Vector<T>& v, F convert) {
+    zv->Reserve(v.size());
+
+    unsigned int idx = 0;
+    for ( const auto& i : v )
+        zv->Assign(idx++, convert(i));
+}
+
+/**
+ * Fills a Zeek vector with the elements of a Spicy-side vector of integers,
+ * reals, or bools. Compared to converting each element individually, this
+ * checks the element type just once upfront, validates the range of all
+ * elements in a single pass, and pre-sizes the target.
+ */
+template<typename T>
+inline void vector_assign_bulk(::zeek::VectorVal* zv, const hilti::rt::Vector<T>& v, const ::zeek::TypePtr& yield,
+                               const std::string& location) {
+    const auto tag = yield->Tag();
+
+    if constexpr ( std::is_same<T, double>::value ) {
+        if ( tag != ::zeek::TYPE_DOUBLE )
+            throw TypeMismatch("double", yield, location);
+
+        vector_fill(zv, v, [](double r) { return ::zeek::make_intrusive<::zeek::DoubleVal>(r); });
+    }
+    else if constexpr ( std::is_same<T, hilti::rt::Bool>::value ) {
+        if ( tag != ::zeek::TYPE_BOOL )
+            throw TypeMismatch("bool", yield, location);
+
+        vector_fill(zv, v, [](const hilti::rt::Bool& b) { return ::zeek::val_mgr->Bool(b); });
+    }
+    else {
+        using Native = std::decay_t<decltype(std::declval<T>().Ref())>;
+        constexpr bool is_signed = std::is_signed<Native>::value;
+
+        if ( tag == ::zeek::TYPE_COUNT ) {
+            if constexpr ( is_signed ) {
+                // Check all elements without early exit, which the compiler can vectorize.
+                bool negative = false;
+                for ( const auto& i : v )
+                    negative |= (i.Ref() < 0);
+
+                if ( negative )
+                    throw TypeMismatch("negative int64", yield, location);
+            }
+
+            vector_fill(zv, v, [](const T& i) { return ::zeek::val_mgr->Count(static_cast<zeek_uint_t>(i.Ref())); });
+        }
+        else if ( tag == ::zeek::TYPE_INT ) {
+            if constexpr ( ! is_signed && sizeof(Native) >= sizeof(zeek_int_t) ) {
+                // Check all elements without early exit, as above.
+                bool overflow = false;
+                for ( const auto& i : v )
+                    overflow |= (i.Ref() > static_cast<Native>(std::numeric_limits<zeek_int_t>::max()));
+
+                if ( overflow ) {
+                    // Let the per-element conversion report the error, so
+                    // that it's the same as for individual values.
+                    for ( const auto& i : v )
+                        to_val(i, yield, location);
+                }
+            }
+
+            vector_fill(zv, v, [](const T& i) { return ::zeek::val_mgr->Int(static_cast<zeek_int_t>(i.Ref())); });
+        }
+        else
+            throw TypeMismatch(is_signed ? "int64" : "uint64", yield, location);
+    }
+}
+
+} // namespace detail
+
 /**
  * Converts a Spicy-side vector to a Zeek value. The result is returned with
  * ref count +1.
  */
 template<typename T>
-inline ::zeek::ValPtr to_val(const hilti::rt::Vector<T>& v, ::zeek::TypePtr target, const std::string& location) {
+inline ::zeek::ValPtr to_val(const hilti::rt::Vector<T>& v, const ::zeek::TypePtr& target,
+                             const std::string& location) {
     if ( target->Tag() != ::zeek::TYPE_VECTOR && target->Tag() != ::zeek::TYPE_LIST )
         throw TypeMismatch("expected vector or list", target, location);
 
     auto vt = ::zeek::cast_intrusive<::zeek::VectorType>(target);
     auto zv = ::zeek::make_intrusive<::zeek::VectorVal>(vt);
-    for ( const auto& i : v )
-        zv->Assign(zv->Size(), to_val(i, vt->Yield(), location));
+
+    if constexpr ( detail::is_bulk_convertible<T>::value )
+        detail::vector_assign_bulk(zv.get(), v, vt->Yield(), location);
+    else {
+        for ( const auto& i : v )
+            zv->Assign(zv->Size(), to_val(i, vt->Yield(), location));
+    }
 
     return zv;
 }
 
+namespace detail {
+
+/**
+ * Checks that a Spicy-side key type can index a Zeek table. Tuples map to
+ * compound indices with one Zeek-side type per element; all other types
+ * to indices of a single type.
+ */
+template<typename K>
+inline void check_table_index(const std::vector<::zeek::TypePtr>& itypes, const ::zeek::TypePtr& target,
+                              const std::string& location) {
+    if constexpr ( hilti::rt::is_tuple<K>::value ) {
+        if ( std::tuple_size<K>::value != itypes.size() )
+            throw TypeMismatch("tuple index with mismatching number of elements", target, location);
+    }
+    else {
+        if ( itypes.size() != 1 )
+            throw TypeMismatch("compound index for non-tuple elements", target, location);
+    }
+}
+
+/**
+ * Converts a Spicy-side map key or set element to a Zeek table index. For
+ * tuples, this builds the compound index in a single pass over the
+ * elements. Expects `check_table_index()` to have been called. Throws if
+ * the index, or any of its elements, is unset, as Zeek cannot index
+ * tables with that.
+ */
+template<typename K>
+inline ::zeek::ValPtr table_index(const K& k, const std::vector<::zeek::TypePtr>& itypes,
+                                  const std::string& location) {
+    if constexpr ( hilti::rt::is_tuple<K>::value ) {
+        auto lv = ::zeek::make_intrusive<::zeek::ListVal>(::zeek::TYPE_ANY);
+        size_t idx = 0;
+        hilti::rt::tuple_for_each(k, [&](const auto& x) {
+            ::zeek::ValPtr v = nullptr;
+
+            if constexpr ( ! std::is_same<decltype(x), const hilti::rt::Null&>::value )
+                // This returns a nullptr for unset optionals.
+                v = to_val(x, itypes[idx], location);
+
+            if ( ! v )
+                throw TypeMismatch(hilti::rt::fmt("missing initialization for index element %zu", idx), location);
+
+            lv->Append(std::move(v));
+            idx++;
+        });
+
+        return lv;
+    }
+    else {
+        auto v = to_val(k, itypes[0], location);
+        if ( ! v )
+            throw TypeMismatch("missing initialization for index", location);
+
+        return v;
+    }
+}
+
+} // namespace detail
+
 /**
  * Converts a Spicy-side map to a Zeek value. The result is returned with
  * ref count +1.
  */
 template<typename K, typename V>
-inline ::zeek::ValPtr to_val(const hilti::rt::Map<K, V>& m, ::zeek::TypePtr target, const std::string& location) {
-    if constexpr ( hilti::rt::is_tuple<K>::value )
-        throw TypeMismatch("internal error: sets with tuples not yet supported in to_val()");
-
+inline ::zeek::ValPtr to_val(const hilti::rt::Map<K, V>& m, const ::zeek::TypePtr& target,
+                             const std::string& location) {
     if ( target->Tag() != ::zeek::TYPE_TABLE )
         throw TypeMismatch("map", target, location);
 
@@ -617,26 +1013,27 @@ inline ::zeek::ValPtr to_val(const hilti::rt::Map<K, V>& m, ::zeek::TypePtr targ
     if ( tt->IsSet() )
         throw TypeMismatch("map", target, location);
 
-    if ( tt->GetIndexTypes().size() != 1 )
-        throw TypeMismatch("map with non-tuple elements", target, location);
+    const auto& itypes = tt->GetIndexTypes();
+    const auto& ytype = tt->Yield();
+    detail::check_table_index<K>(itypes, target, location);
 
     auto zv = ::zeek::make_intrusive<::zeek::TableVal>(tt);
 
     for ( const auto& i : m ) {
-        auto k = to_val(i.first, tt->GetIndexTypes()[0], location);
-        auto v = to_val(i.second, tt->Yield(), location);
+        auto k = detail::table_index(i.first, itypes, location);
+        auto v = to_val(i.second, ytype, location);
         zv->Assign(std::move(k), std::move(v));
     }
 
     return zv;
-} // namespace spicy::zeek::rt
+}
 
 /**
  * Converts a Spicy-side set to a Zeek value. The result is returned with
  * ref count +1.
  */
 template<typename T>
-inline ::zeek::ValPtr to_val(const hilti::rt::Set<T>& s, ::zeek::TypePtr target, const std::string& location) {
+inline ::zeek::ValPtr to_val(const hilti::rt::Set<T>& s, const ::zeek::TypePtr& target, const std::string& location) {
     if ( target->Tag() != ::zeek::TYPE_TABLE )
         throw TypeMismatch("set", target, location);
 
@@ -644,19 +1041,13 @@ inline ::zeek::ValPtr to_val(const hilti::rt::Set<T>& s, ::zeek::TypePtr target,
     if ( ! tt->IsSet() )
         throw TypeMismatch("set", target, location);
 
-    auto zv = ::zeek::make_intrusive<::zeek::TableVal>(tt);
+    const auto& itypes = tt->GetIndexTypes();
+    detail::check_table_index<T>(itypes, target, location);
 
-    for ( const auto& i : s ) {
-        if constexpr ( hilti::rt::is_tuple<T>::value )
-            throw TypeMismatch("internal error: sets with tuples not yet supported in to_val()");
-        else {
-            if ( tt->GetIndexTypes().size() != 1 )
-                throw TypeMismatch("set with non-tuple elements", target, location);
+    auto zv = ::zeek::make_intrusive<::zeek::TableVal>(tt);
 
-            auto idx = to_val(i, tt->GetIndexTypes()[0], location);
-            zv->Assign(std::move(idx), nullptr);
-        }
-    }
+    for ( const auto& i : s )
+        zv->Assign(detail::table_index(i, itypes, location), nullptr);
 
     return zv;
 }
@@ -666,11 +1057,12 @@ inline ::zeek::ValPtr to_val(const hilti::rt::Set<T>& s, ::zeek::TypePtr target,
  * with ref count +1.
  */
 template<typename T, typename std::enable_if_t<hilti::rt::is_tuple<T>::value>*>
-inline ::zeek::ValPtr to_val(const T& t, ::zeek::TypePtr target, const std::string& location) {
+inline ::zeek::ValPtr to_val(const T& t, const ::zeek::TypePtr& target, const std::string& location) {
     if ( target->Tag() != ::zeek::TYPE_RECORD )
         throw TypeMismatch("tuple", target, location);
 
-    auto rtype = ::zeek::cast_intrusive<::zeek::RecordType>(target);
+    auto& conv = detail::conversion_table<T, detail::RecordConversion>(target);
+    const auto& rtype = conv.rtype;
 
     if ( std::tuple_size<T>::value != rtype->NumFields() )
         throw TypeMismatch("tuple", target, location);
@@ -688,11 +1080,10 @@ inline ::zeek::ValPtr to_val(const T& t, ::zeek::TypePtr target, const std::stri
             v = to_val(x, rtype->GetFieldType(idx), location);
 
         if ( v )
-            rval->Assign(idx, v);
+            rval->Assign(idx, std::move(v));
         else {
             // Field must be &optional or &default.
-            if ( auto attrs = rtype->FieldDecl(idx)->attrs; ! attrs || ! (attrs->Find(::zeek::detail::ATTR_DEFAULT) ||
-                                                                          attrs->Find(::zeek::detail::ATTR_OPTIONAL)) )
+            if ( ! conv.can_be_unset[idx] )
                 throw TypeMismatch(hilti::rt::fmt("missing initialization for field '%s'", rtype->FieldName(idx)),
                                    location);
         }
@@ -708,11 +1099,12 @@ inline ::zeek::ValPtr to_val(const T& t, ::zeek::TypePtr target, const std::stri
  * with a ref count +1.
  */
 template<typename T, typename std::enable_if_t<std::is_base_of<::hilti::rt::trait::isStruct, T>::value>*>
-inline ::zeek::ValPtr to_val(const T& t, ::zeek::TypePtr target, const std::string& location) {
+inline ::zeek::ValPtr to_val(const T& t, const ::zeek::TypePtr& target, const std::string& location) {
     if ( target->Tag() != ::zeek::TYPE_RECORD )
         throw TypeMismatch("struct", target, location);
 
-    auto rtype = ::zeek::cast_intrusive<::zeek::RecordType>(target);
+    auto& conv = detail::conversion_table<T, detail::RecordConversion>(target);
+    const auto& rtype = conv.rtype;
 
     auto rval = ::zeek::make_intrusive<::zeek::RecordVal>(rtype);
     int idx = 0;
@@ -723,12 +1115,16 @@ inline ::zeek::ValPtr to_val(const T& t, ::zeek::TypePtr target, const std::stri
         if ( idx >= num_fields )
             throw TypeMismatch(hilti::rt::fmt("no matching record field for field '%s'", name), location);
 
-        auto field = rtype->GetFieldType(idx);
-        std::string field_name = rtype->FieldName(idx);
+        const auto& field = rtype->GetFieldType(idx);
 
-        if ( field_name != name )
-            throw TypeMismatch(hilti::rt::fmt("mismatch in field name: expected '%s', found '%s'", name, field_name),
-                               location);
+        // Field names are static, so we need to compare them only once.
+        if ( ! conv.validated ) {
+            std::string field_name = rtype->FieldName(idx);
+            if ( field_name != name )
+                throw TypeMismatch(hilti::rt::fmt("mismatch in field name: expected '%s', found '%s'", name,
+                                                  field_name),
+                                   location);
+        }
 
         ::zeek::ValPtr v = nullptr;
 
@@ -740,12 +1136,12 @@ inline ::zeek::ValPtr to_val(const T& t, ::zeek::TypePtr target, const std::stri
             v = to_val(val, field, location);
 
         if ( v )
-            rval->Assign(idx, v);
+            rval->Assign(idx, std::move(v));
         else {
             // Field must be &optional or &default.
-            if ( auto attrs = rtype->FieldDecl(idx)->attrs; ! attrs || ! (attrs->Find(::zeek::detail::ATTR_DEFAULT) ||
-                                                                          attrs->Find(::zeek::detail::ATTR_OPTIONAL)) )
-                throw TypeMismatch(hilti::rt::fmt("missing initialization for field '%s'", field_name), location);
+            if ( ! conv.can_be_unset[idx] )
+                throw TypeMismatch(hilti::rt::fmt("missing initialization for field '%s'", rtype->FieldName(idx)),
+                                   location);
         }
 
         idx++;
@@ -757,6 +1153,7 @@ inline ::zeek::ValPtr to_val(const T& t, ::zeek::TypePtr target, const std::stri
         throw TypeMismatch(hilti::rt::fmt("missing initialization for field '%s'", rtype->FieldName(idx + 1)),
                            location);
 
+    conv.validated = true;
     return rval;
 }
 
@@ -765,7 +1162,7 @@ inline ::zeek::ValPtr to_val(const T& t, ::zeek::TypePtr target, const std::stri
  * with ref count +1.
  */
 template<typename T, typename std::enable_if_t<std::is_enum<typename T::Value>::value>*>
-inline ::zeek::ValPtr to_val(const T& t, ::zeek::TypePtr target, const std::string& location) {
+inline ::zeek::ValPtr to_val(const T& t, const ::zeek::TypePtr& target, const std::string& location) {
 #if SPICY_VERSION_NUMBER >= 10700
     auto proto = typename T::Value(t.value());
 #else
@@ -782,7 +1179,7 @@ inline ::zeek::ValPtr to_val(const T& t, ::zeek::TypePtr target, const std::stri
  * TODO(bbannier): remove this once we drop support for Spicy versions before 1.7.0.
  */
 template<typename T, typename std::enable_if_t<std::is_enum<T>::value>*>
-inline ::zeek::ValPtr to_val(const T& t, ::zeek::TypePtr target, const std::string& location) {
+inline ::zeek::ValPtr to_val(const T& t, const ::zeek::TypePtr& target, const std::string& location) {
     if ( target->Tag() != ::zeek::TYPE_ENUM )
         throw TypeMismatch("enum", target, location);
 
@@ -798,7 +1195,7 @@ inline ::zeek::ValPtr to_val(const T& t, ::zeek::TypePtr target, const std::stri
 
     zeek_int_t bt = (it >= 0 ? it : std::numeric_limits<::zeek_int_t>::max());
 
-    return target->AsEnumType()->GetEnumVal(bt);
+    return detail::conversion_table<T, detail::EnumConversion>(target).get(bt);
 }
 
 } // namespace spicy::zeek::rt
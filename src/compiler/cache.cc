@@ -0,0 +1,228 @@
+// Copyright (c) 2020-2021 by the Zeek Project. See LICENSE for details.
+
+#include <unistd.h>
+
+#include <cinttypes>
+#include <fstream>
+#include <optional>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <hilti/rt/util.h>
+
+#include <hilti/base/util.h>
+
+#include <zeek-spicy/autogen/config.h>
+#include <zeek-spicy/compiler/cache.h>
+#include <zeek-spicy/compiler/debug.h>
+
+using namespace spicy::zeek;
+
+// Magic first line of a cache entry's dependency file. Bump the version when
+// changing what goes into an entry.
+static const char* ManifestHeader = "spicyz-cache 2";
+
+namespace {
+
+/**
+ * Incremental 128-bit digest built from two differently seeded FNV-1a
+ * hashes. This isn't cryptographically strong, but the cache only needs to
+ * tell apart different versions of the same inputs.
+ */
+class Digest {
+public:
+    void update(const char* data, size_t len) {
+        for ( size_t i = 0; i < len; i++ ) {
+            _h1 = (_h1 ^ static_cast<uint8_t>(data[i])) * Prime;
+            _h2 = (_h2 ^ static_cast<uint8_t>(data[i])) * Prime;
+        }
+    }
+
+    // Adds a string including its length, so that concatenations can't collide.
+    void update(const std::string& s) {
+        auto len = std::to_string(s.size()) + ":";
+        update(len.data(), len.size());
+        update(s.data(), s.size());
+    }
+
+    std::string hex() const { return hilti::rt::fmt("%016" PRIx64 "%016" PRIx64, _h1, _h2); }
+
+private:
+    static constexpr uint64_t Prime = 0x100000001b3ULL;
+    uint64_t _h1 = 0xcbf29ce484222325ULL;
+    uint64_t _h2 = 0x84222325cbf29ce4ULL;
+};
+
+} // namespace
+
+// Adds a file's content to a digest, returning false if the file cannot be read.
+static bool digestFile(Digest* digest, const hilti::rt::filesystem::path& path) {
+    std::ifstream in(path, std::ios::binary);
+    if ( ! in )
+        return false;
+
+    char buffer[64 * 1024];
+    while ( in ) {
+        in.read(buffer, sizeof(buffer));
+        digest->update(buffer, in.gcount());
+    }
+
+    return ! in.bad();
+}
+
+// Returns the digest of a file's content, or an empty string if it cannot be read.
+static std::string fileDigest(const hilti::rt::filesystem::path& path) {
+    Digest digest;
+    if ( ! digestFile(&digest, path) )
+        return "";
+
+    return digest.hex();
+}
+
+// Copies a file atomically by going through a temporary file next to the destination.
+static bool copyAtomically(const hilti::rt::filesystem::path& src, const hilti::rt::filesystem::path& dst) {
+    std::error_code ec;
+    auto tmp = dst;
+    tmp += hilti::rt::fmt(".tmp.%d", getpid());
+
+    hilti::rt::filesystem::copy_file(src, tmp, hilti::rt::filesystem::copy_options::overwrite_existing, ec);
+    if ( ! ec )
+        hilti::rt::filesystem::rename(tmp, dst, ec);
+
+    if ( ec ) {
+        ZEEK_DEBUG(hilti::util::fmt("cannot copy %s to %s: %s", src, dst, ec.message()));
+        hilti::rt::filesystem::remove(tmp, ec);
+        return false;
+    }
+
+    return true;
+}
+
+hilti::Result<std::string> CompilationCache::computeKey(const std::vector<hilti::rt::filesystem::path>& inputs,
+                                                        const std::vector<std::string>& options) {
+    Digest digest;
+    digest.update(ManifestHeader);
+    digest.update(std::to_string(SPICY_VERSION_NUMBER));
+    digest.update(std::to_string(spicy::zeek::configuration::ZeekVersionNumber));
+    digest.update(spicy::zeek::configuration::PluginVersion);
+
+    // These extend the module search paths, so they may change what imports
+    // resolve to, or configure the C++ compilation producing the object code.
+    for ( const auto* env : {"ZEEK_SPICY_PATH", "SPICY_PATH", "HILTI_PATH", "HILTI_CXX", "HILTI_CXX_FLAGS",
+                             "HILTI_CXX_INCLUDE_DIRS"} ) {
+        digest.update(env);
+        digest.update(hilti::rt::getenv(env).value_or(""));
+    }
+
+    for ( const auto& o : options )
+        digest.update(o);
+
+    for ( const auto& i : inputs ) {
+        std::error_code ec;
+        auto path = hilti::rt::filesystem::canonical(i, ec);
+        if ( ec )
+            return hilti::result::Error(hilti::util::fmt("cannot resolve input %s: %s", i, ec.message()));
+
+        // We include the path because relative imports resolve relative to it.
+        digest.update(path.native());
+
+        if ( ! digestFile(&digest, path) )
+            return hilti::result::Error(hilti::util::fmt("cannot read input %s", path));
+    }
+
+    return digest.hex();
+}
+
+bool CompilationCache::lookup(const std::string& key, const hilti::rt::filesystem::path& output,
+                              const std::optional<hilti::rt::filesystem::path>& index) const {
+    std::ifstream manifest(_dir / (key + ".deps"));
+    if ( ! manifest ) {
+        ZEEK_DEBUG(hilti::util::fmt("cache miss for %s", key));
+        return false;
+    }
+
+    std::string line;
+    if ( ! std::getline(manifest, line) || line != ManifestHeader ) {
+        ZEEK_DEBUG(hilti::util::fmt("ignoring cache entry %s with unknown format", key));
+        return false;
+    }
+
+    // Each line records "<digest> <path>" for one source file that went into the entry.
+    while ( std::getline(manifest, line) ) {
+        auto sep = line.find(' ');
+        if ( sep == std::string::npos )
+            return false;
+
+        auto path = hilti::rt::filesystem::path(line.substr(sep + 1));
+        if ( fileDigest(path) != line.substr(0, sep) ) {
+            ZEEK_DEBUG(hilti::util::fmt("cache entry %s is stale, %s changed", key, path));
+            return false;
+        }
+    }
+
+    if ( index && ! hilti::rt::filesystem::exists(_dir / (key + ".idx")) ) {
+        ZEEK_DEBUG(hilti::util::fmt("cache entry %s has no index", key));
+        return false;
+    }
+
+    if ( ! copyAtomically(_dir / (key + ".hlto"), output) )
+        return false;
+
+    if ( index && ! copyAtomically(_dir / (key + ".idx"), *index) )
+        return false;
+
+    ZEEK_DEBUG(hilti::util::fmt("cache hit for %s", key));
+    return true;
+}
+
+hilti::Result<hilti::Nothing> CompilationCache::store(const std::string& key, const hilti::rt::filesystem::path& output,
+                                                      const std::set<hilti::rt::filesystem::path>& dependencies,
+                                                      const std::optional<hilti::rt::filesystem::path>& index) const {
+    std::error_code ec;
+    hilti::rt::filesystem::create_directories(_dir, ec);
+    if ( ec )
+        return hilti::result::Error(hilti::util::fmt("cannot create cache directory %s: %s", _dir, ec.message()));
+
+    std::string manifest = std::string(ManifestHeader) + "\n";
+
+    for ( const auto& d : dependencies ) {
+        auto digest = fileDigest(d);
+        if ( digest.empty() )
+            return hilti::result::Error(hilti::util::fmt("cannot read dependency %s", d));
+
+        manifest += hilti::util::fmt("%s %s\n", digest, d.native());
+    }
+
+    // Write the object first so that an existing manifest always implies an existing object.
+    if ( ! copyAtomically(output, _dir / (key + ".hlto")) )
+        return hilti::result::Error(hilti::util::fmt("cannot store %s in cache", output));
+
+    if ( index ) {
+        if ( ! copyAtomically(*index, _dir / (key + ".idx")) )
+            return hilti::result::Error(hilti::util::fmt("cannot store %s in cache", *index));
+    }
+    else
+        // Don't leave an index behind that may not match the new object.
+        hilti::rt::filesystem::remove(_dir / (key + ".idx"), ec);
+
+    auto manifest_path = _dir / (key + ".deps");
+    auto tmp = manifest_path;
+    tmp += hilti::rt::fmt(".tmp.%d", getpid());
+
+    {
+        std::ofstream out(tmp);
+        out << manifest;
+        if ( ! out )
+            return hilti::result::Error(hilti::util::fmt("cannot write %s", tmp));
+    }
+
+    hilti::rt::filesystem::rename(tmp, manifest_path, ec);
+    if ( ec ) {
+        hilti::rt::filesystem::remove(tmp, ec);
+        return hilti::result::Error(hilti::util::fmt("cannot write %s", manifest_path));
+    }
+
+    ZEEK_DEBUG(hilti::util::fmt("stored %s in cache as %s", output, key));
+    return hilti::Nothing();
+}
@@ -247,13 +247,15 @@ std::vector<std::pair<TypeInfo, hilti::ID>> Driver::exportedTypes() const {
 }
 
 void Driver::hookNewASTPreCompilation(std::shared_ptr<hilti::Unit> unit) {
-    if ( unit->extension() != ".spicy" )
-        return;
-
     if ( unit->path().empty() )
         // Ignore modules constructed in memory.
         return;
 
+    _source_files.insert(unit->path());
+
+    if ( unit->extension() != ".spicy" )
+        return;
+
     auto v = VisitorTypes(this, unit->id(), unit->path(), false);
     for ( auto i : v.walk(unit->module()) )
         v.dispatch(i);
@@ -540,6 +540,51 @@ void GlueCompiler::addSpicyModule(const hilti::ID& id, const hilti::rt::filesyst
     _spicy_modules[id] = std::make_shared<glue::SpicyModule>(std::move(module));
 }
 
+void GlueCompiler::writeIndex(std::ostream& out) const {
+    out << "# Analyzers and events defined by this module, generated by spicyz.\n";
+
+    for ( const auto& a : _protocol_analyzers ) {
+#if SPICY_VERSION_NUMBER >= 10700
+        auto proto = a.protocol.value();
+#else
+        auto proto = a.protocol;
+#endif
+
+        std::string transport;
+        switch ( proto ) {
+            case hilti::rt::Protocol::TCP: transport = "tcp"; break;
+            case hilti::rt::Protocol::UDP: transport = "udp"; break;
+            default: transport = "unknown";
+        }
+
+        out << "protocol " << a.name << ' ' << transport;
+
+        for ( const auto& p : a.ports )
+            out << ' ' << p;
+
+        out << '\n';
+    }
+
+    for ( const auto& a : _file_analyzers ) {
+        out << "file " << a.name;
+
+        for ( const auto& mt : a.mime_types )
+            out << ' ' << mt;
+
+        out << '\n';
+    }
+
+    for ( const auto& a : _packet_analyzers )
+        out << "packet " << a.name << '\n';
+
+    std::set<std::string> events;
+    for ( const auto& ev : _events )
+        events.insert(ev.name);
+
+    for ( const auto& ev : events )
+        out << "event " << ev << '\n';
+}
+
 glue::ProtocolAnalyzer GlueCompiler::parseProtocolAnalyzer(const std::string& chunk) {
     glue::ProtocolAnalyzer a;
     a.location = _locations.back();
@@ -1075,16 +1120,42 @@ bool GlueCompiler::CreateSpicyHook(glue::Event* ev) {
     auto import_ = hilti::declaration::ImportedModule(ev->unit_module_id, ev->unit_module_path);
     ev->spicy_module->spicy_module->add(std::move(import_));
 
-    // Define Zeek-side event handler.
+    // Define Zeek-side event handler. This resolves the event's plan once
+    // at initialization time, when the Zeek-side event type is final. The
+    // plan also stores the locations of all arguments, so that the hook
+    // doesn't need to construct any strings for them when raising the event.
     auto handler_id = ID(hilti::util::fmt("__zeek_handler_%s", mangled_event_name));
-    auto handler = builder::global(handler_id, builder::call("zeek_rt::internal_handler", {builder::string(ev->name)}),
-                                   hilti::declaration::Linkage::Private, meta);
+    std::vector<Expression> arg_locations;
+    for ( const auto& e : ev->expression_accessors )
+        arg_locations.push_back(location(e));
+
+    auto plan = builder::call("zeek_rt::event_plan",
+                              {builder::string(ev->name), builder::vector(hilti::type::String(), arg_locations),
+                               location(*ev)});
+    auto handler = builder::global(handler_id, std::move(plan), hilti::declaration::Linkage::Private, meta);
     ev->spicy_module->spicy_module->add(std::move(handler));
 
     // Create the hook body that raises the event.
     auto body = hilti::builder::Builder(_driver->context());
 
-    // If the event comes with a condition, evaluate that first.
+    // Store reference to handler locally to avoid repeated lookups through globals store.
+    body.addLocal("handler", builder::id(handler_id), meta);
+
+    // Nothing to do if there's no handler defined. Unless we're logging
+    // events, we check that first so that hooks for events without handlers
+    // return right away, without evaluating anything else. Whether there's
+    // a handler is determined at runtime each time, so this picks up on
+    // handlers getting enabled or disabled later.
+    auto add_handler_check = [&]() {
+        auto have_handler = builder::call("zeek_rt::have_handler", {builder::id("handler")}, meta);
+        auto exit_ = body.addIf(builder::not_(have_handler), meta);
+        exit_->addReturn(meta);
+    };
+
+    if ( ! _driver->hiltiOptions().debug )
+        add_handler_check();
+
+    // If the event comes with a condition, evaluate that next.
     if ( ev->condition.size() ) {
         auto cond = spicy::parseExpression(ev->condition, meta);
         if ( ! cond ) {
@@ -1123,31 +1194,32 @@ bool GlueCompiler::CreateSpicyHook(glue::Event* ev) {
         auto msg = builder::modulo(builder::string(fmt_str), builder::tuple(fmt_args));
         auto call = builder::call("zeek_rt::debug", {std::move(msg)});
         body.addExpression(call);
-    }
 
-    // Store reference to handler locally to avoid repeated lookups through globals store.
-    body.addLocal("handler", builder::id(handler_id), meta);
+        add_handler_check();
+    }
 
-    // Nothing to do if there's not handler defined.
-    auto have_handler = builder::call("zeek_rt::have_handler", {builder::id("handler")}, meta);
-    auto exit_ = body.addIf(builder::not_(have_handler), meta);
-    exit_->addReturn(meta);
+    // Report a mismatch with the Zeek-side prototype only now, so that it's
+    // reported only for events actually getting raised, in both debug and
+    // release builds.
+    body.addExpression(builder::call("zeek_rt::check_event_args", {builder::id("handler")}, meta));
 
-    // Build event's argument vector.
-    body.addLocal(ID("args"), hilti::type::Vector(builder::typeByID("zeek_rt::Val"), meta), meta);
+    // Build event's argument list, reserved to the event's arity so that
+    // Zeek's argument vector gets built in place.
+    body.addLocal(ID("args"), builder::call("zeek_rt::event_args", {builder::id("handler")}, meta), meta);
 
     int i = 0;
     for ( const auto& e : ev->expression_accessors ) {
         Expression val;
+        auto loc = builder::call("zeek_rt::event_arg_location", {builder::id("handler"), builder::integer(i)}, meta);
 
         if ( e.expression == "$conn" )
-            val = builder::call("zeek_rt::current_conn", {location(e)}, meta);
+            val = builder::call("zeek_rt::current_conn", {loc}, meta);
         else if ( e.expression == "$file" )
-            val = builder::call("zeek_rt::current_file", {location(e)}, meta);
+            val = builder::call("zeek_rt::current_file", {loc}, meta);
         else if ( e.expression == "$packet" )
-            val = builder::call("zeek_rt::current_packet", {location(e)}, meta);
+            val = builder::call("zeek_rt::current_packet", {loc}, meta);
         else if ( e.expression == "$is_orig" )
-            val = builder::call("zeek_rt::current_is_orig", {location(e)}, meta);
+            val = builder::call("zeek_rt::current_is_orig", {loc}, meta);
         else {
             if ( hilti::util::startsWith(e.expression, "$") ) {
                 hilti::logger().error(hilti::util::fmt("unknown reserved parameter '%s'", e.expression));
@@ -1160,17 +1232,15 @@ bool GlueCompiler::CreateSpicyHook(glue::Event* ev) {
                 return false;
             }
 
-            auto ztype = builder::call("zeek_rt::event_arg_type",
-                                       {builder::id("handler"), builder::integer(i), location(e)}, meta);
-            val = builder::call("zeek_rt::to_val", {std::move(*expr), ztype, location(e)}, meta);
+            auto ztype = builder::call("zeek_rt::event_arg_type", {builder::id("handler"), builder::integer(i)}, meta);
+            val = builder::call("zeek_rt::to_val", {std::move(*expr), ztype, loc}, meta);
         }
 
-        body.addMemberCall(builder::id("args"), "push_back", {val}, meta);
+        body.addCall("zeek_rt::event_arg_add", {builder::id("args"), std::move(val), loc}, meta);
         i++;
     }
 
-    body.addCall("zeek_rt::raise_event", {builder::id("handler"), builder::move(builder::id("args")), location(*ev)},
-                 meta);
+    body.addCall("zeek_rt::raise_event", {builder::id("handler"), builder::move(builder::id("args"))}, meta);
 
     auto attrs = hilti::AttributeSet({hilti::Attribute("&priority", builder::integer(ev->priority))});
     auto unit_hook = spicy::Hook(ev->parameters, body.block(), spicy::Engine::All, {}, meta);
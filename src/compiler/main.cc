@@ -1,19 +1,29 @@
 // Copyright (c) 2020-2021 by the Zeek Project. See LICENSE for details.
 
 #include <getopt.h>
+#include <stdlib.h>
+
+#include <fstream>
+#include <optional>
+#include <string>
+#include <vector>
 
 #include <hilti/base/result.h>
 #include <hilti/base/util.h>
 
 #include <zeek-spicy/autogen/config.h>
+#include <zeek-spicy/compiler/cache.h>
 #include <zeek-spicy/compiler/driver.h>
 #include <zeek-spicy/compiler/glue-compiler.h>
 #include <zeek-spicy/compiler/debug.h>
 
 constexpr int OPT_CXX_LINK = 1000;
+constexpr int OPT_CACHE_DIR = 1001;
+constexpr int OPT_WRITE_INDEX = 1002;
 
 static struct option long_driver_options[] = {{"abort-on-exceptions", required_argument, nullptr, 'A'},
                                               {"show-backtraces", required_argument, nullptr, 'B'},
+                                              {"cache-dir", required_argument, nullptr, OPT_CACHE_DIR},
                                               {"compiler-debug", required_argument, nullptr, 'D'},
                                               {"cxx-link", required_argument, nullptr, OPT_CXX_LINK},
                                               {"debug", no_argument, nullptr, 'd'},
@@ -21,6 +31,7 @@ static struct option long_driver_options[] = {{"abort-on-exceptions", required_a
                                               {"disable-optimizations", no_argument, nullptr, 'g'},
                                               {"dump-code", no_argument, nullptr, 'C'},
                                               {"help", no_argument, nullptr, 'h'},
+                                              {"jobs", required_argument, nullptr, 'j'},
                                               {"keep-tmps", no_argument, nullptr, 'T'},
                                               {"library-path", required_argument, nullptr, 'L'},
                                               {"output", required_argument, nullptr, 'o'},
@@ -35,6 +46,7 @@ static struct option long_driver_options[] = {{"abort-on-exceptions", required_a
                                               {"skip-validation", no_argument, nullptr, '!'},
                                               {"version", no_argument, nullptr, 'v'},
                                               {"version-number", no_argument, nullptr, 'V'},
+                                              {"write-index", no_argument, nullptr, OPT_WRITE_INDEX},
                                               {nullptr, 0, nullptr, 0}};
 
 static void usage() {
@@ -43,6 +55,7 @@ static void usage() {
                  "  -c | --output-c++ <prefix>      Output generated C++ code.\n"
                  "  -d | --debug                    Include debug instrumentation into generated code.\n"
                  "  -g | --disable-optimizations    Disable HILTI-side optimizations of the generated code.\n"
+                 "  -j | --jobs <n>                 Compile up to <n> modules in parallel (default: number of cores).\n"
                  "  -o | --output-to <path>         Path for saving output.\n"
                  "  -v | --version                  Print version information.\n"
                  "  -x | --output-c++ <prefix>      Output generated C++ code into set of files.\n"
@@ -65,6 +78,9 @@ static void usage() {
                  "(comma-separated; see 'help' for list).\n"
                  "       --cxx-link <lib>           Link specified static archive or shared library during JIT or to "
                  "\n"
+                 "       --cache-dir <dir>          Reuse previously compiled output from this directory if inputs are "
+                 "unchanged (default: $SPICYZ_CACHE_DIR).\n"
+                 "       --write-index              Write an index of analyzers and events to <output>.idx.\n"
                  "Inputs can be *.spicy, *.evt, *.hlt, .cc/.cxx\n"
                  "\n";
 }
@@ -95,13 +111,18 @@ static auto pluginPath() {
 }
 
 static hilti::Result<Nothing> parseOptions(int argc, char** argv, hilti::driver::Options* driver_options,
-                                           hilti::Options* compiler_options) {
+                                           hilti::Options* compiler_options, std::string* cache_dir,
+                                           std::vector<std::string>* cache_options, bool* write_index) {
     while ( true ) {
-        int c = getopt_long(argc, argv, "ABc:Cdgx:X:D:L:Mo:pPRSTvhz", long_driver_options, nullptr);
+        int c = getopt_long(argc, argv, "ABc:Cdgj:x:X:D:L:Mo:pPRSTvhz", long_driver_options, nullptr);
 
         if ( c == -1 )
             break;
 
+        // Record everything that may affect the generated code for the compilation cache.
+        if ( c != 'j' && c != 'o' && c != 'R' && c != 'T' && c != OPT_CACHE_DIR && c != OPT_WRITE_INDEX )
+            cache_options->emplace_back(hilti::util::fmt("%d=%s", c, optarg ? optarg : ""));
+
         switch ( c ) {
             case 'A': driver_options->abort_on_exceptions = true; break;
 
@@ -132,6 +153,18 @@ static hilti::Result<Nothing> parseOptions(int argc, char** argv, hilti::driver:
                 break;
             }
 
+            case 'j': {
+                char* end = nullptr;
+                if ( ! *optarg || strtoul(optarg, &end, 10) == 0 || *end )
+                    return hilti::result::Error(hilti::util::fmt("invalid number of jobs '%s'", optarg));
+
+                // HILTI's JIT already compiles the C++ code of each module,
+                // including the glue code, as a separate translation unit;
+                // this controls how many of those it runs concurrently.
+                ::setenv("HILTI_JIT_PARALLELISM", optarg, 1);
+                break;
+            }
+
             case 'p': std::cout << spicy::zeek::configuration::InstallPrefix << std::endl; return Nothing();
 
             case 'P': std::cout << pluginPath().native() << std::endl; return Nothing();
@@ -218,6 +251,10 @@ static hilti::Result<Nothing> parseOptions(int argc, char** argv, hilti::driver:
 #endif
                 break;
 
+            case OPT_CACHE_DIR: *cache_dir = optarg; break;
+
+            case OPT_WRITE_INDEX: *write_index = true; break;
+
             case 'h': usage(); return Nothing();
 
             case '!': compiler_options->skip_validation = true; break;
@@ -248,11 +285,44 @@ int main(int argc, char** argv) {
 
     auto compiler_options = driver.hiltiOptions();
 
-    if ( auto rc = parseOptions(argc, argv, &driver_options, &compiler_options); ! rc ) {
+    std::string cache_dir = hilti::rt::getenv("SPICYZ_CACHE_DIR").value_or("");
+    std::vector<std::string> cache_options;
+    bool write_index = false;
+
+    if ( auto rc = parseOptions(argc, argv, &driver_options, &compiler_options, &cache_dir, &cache_options,
+                                &write_index);
+         ! rc ) {
         hilti::logger().error(rc.error().description());
         return 1;
     }
 
+    const auto output_path = driver_options.output_path;
+    std::optional<hilti::rt::filesystem::path> index_path;
+
+    if ( write_index && ! output_path.empty() ) {
+        index_path = output_path;
+        *index_path += ".idx";
+    }
+
+    // We only cache complete object files, not any C++ output. An entry
+    // includes the index if requested, so a cache hit doesn't need to load
+    // any inputs.
+    std::optional<spicy::zeek::CompilationCache> cache;
+    std::string cache_key;
+
+    if ( ! cache_dir.empty() && ! driver_options.inputs.empty() && ! output_path.empty() &&
+         ! driver_options.output_cxx ) {
+        if ( auto key = spicy::zeek::CompilationCache::computeKey(driver_options.inputs, cache_options) ) {
+            cache.emplace(cache_dir);
+            cache_key = *key;
+
+            if ( cache->lookup(cache_key, output_path, index_path) )
+                return 0;
+        }
+        else
+            hilti::logger().warning(hilti::util::fmt("not using compilation cache: %s", key.error().description()));
+    }
+
     driver.setDriverOptions(std::move(driver_options));
     driver.setCompilerOptions(std::move(compiler_options));
     driver.initialize();
@@ -264,6 +334,18 @@ int main(int argc, char** argv) {
         }
     }
 
+    // The index needs only what the EVT files define, so we can write it
+    // before compiling anything.
+    if ( index_path ) {
+        std::ofstream out(*index_path);
+        driver.glueCompiler()->writeIndex(out);
+
+        if ( ! out ) {
+            hilti::logger().error(hilti::util::fmt("cannot write index %s", *index_path));
+            return 1;
+        }
+    }
+
     if ( auto rc = driver.compile(); ! rc ) {
         hilti::logger().error(rc.error().description());
 
@@ -273,5 +355,19 @@ int main(int argc, char** argv) {
         return 1;
     }
 
+    if ( cache ) {
+        auto dependencies = driver.sourceFiles();
+
+        for ( const auto& i : driver.driverOptions().inputs ) {
+            std::error_code ec;
+            if ( auto p = hilti::rt::filesystem::canonical(i, ec); ! ec )
+                dependencies.insert(p);
+        }
+
+        if ( auto rc = cache->store(cache_key, output_path, dependencies, index_path); ! rc )
+            hilti::logger().warning(
+                hilti::util::fmt("could not update compilation cache: %s", rc.error().description()));
+    }
+
     return 0;
 }
@@ -0,0 +1,251 @@
+// Copyright (c) 2020-2021 by the Zeek Project. See LICENSE for details.
+//
+// Micro-benchmarks for the runtime support layer. These get compiled into
+// the plugin only if configured with ZEEK_SPICY_ENABLE_BENCHMARKS, and run
+// through Spicy::__run_benchmarks() from inside Zeek; see
+// tests/Scripts/run-micro-benchmarks.
+
+#include <benchmark/benchmark.h>
+
+#include <cstdint>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include <zeek-spicy/autogen/config.h>
+#include <zeek-spicy/plugin/benchmarks.h>
+#include <zeek-spicy/plugin/cookie.h>
+#include <zeek-spicy/plugin/runtime-support.h>
+#include <zeek-spicy/plugin/zeek-compat.h>
+
+using namespace spicy::zeek;
+
+namespace {
+
+using Count = hilti::rt::integer::safe<uint64_t>;
+
+// Location passed to all conversions; never reported as nothing fails.
+const std::string Location = "<benchmark>";
+
+// Spicy-side counterpart to the `Spicy::ResourceUsage` record, for the
+// struct-to-record conversion.
+struct ResourceUsage : public hilti::rt::trait::isStruct {
+    hilti::rt::Interval user_time;
+    hilti::rt::Interval system_time;
+    Count memory_heap = 1;
+    Count num_fibers = 2;
+    Count max_fibers = 3;
+    Count cached_fibers = 4;
+
+    template<typename F>
+    void __visit(F f) const {
+        f("user_time", user_time);
+        f("system_time", system_time);
+        f("memory_heap", memory_heap);
+        f("num_fibers", num_fibers);
+        f("max_fibers", max_fibers);
+        f("cached_fibers", cached_fibers);
+    }
+};
+
+// Spicy-side counterpart to Zeek's `transport_proto`, in the form of
+// enums generated by Spicy versions before 1.7.
+enum class Protocol : int64_t { Undef = -1, Unknown = 0, TCP = 1, UDP = 2, ICMP = 3 };
+
+const ::zeek::TypePtr& resourceUsageType() {
+    static auto t = ::zeek::id::find_type("Spicy::ResourceUsage");
+    return t;
+}
+
+void ToValCount(benchmark::State& state) {
+    const auto& target = ::zeek::base_type(::zeek::TYPE_COUNT);
+    Count i = 42;
+
+    for ( auto _ : state )
+        benchmark::DoNotOptimize(rt::to_val(i, target, Location));
+}
+
+void ToValInt(benchmark::State& state) {
+    const auto& target = ::zeek::base_type(::zeek::TYPE_INT);
+    hilti::rt::integer::safe<int64_t> i = -42;
+
+    for ( auto _ : state )
+        benchmark::DoNotOptimize(rt::to_val(i, target, Location));
+}
+
+void ToValBytes(benchmark::State& state) {
+    const auto& target = ::zeek::base_type(::zeek::TYPE_STRING);
+    auto b = hilti::rt::Bytes(std::string(state.range(0), 'x'));
+
+    for ( auto _ : state )
+        benchmark::DoNotOptimize(rt::to_val(b, target, Location));
+
+    state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+
+void ToValVector(benchmark::State& state) {
+    auto target = ::zeek::make_intrusive<::zeek::VectorType>(::zeek::base_type(::zeek::TYPE_COUNT));
+    ::zeek::TypePtr ztarget = target;
+
+    hilti::rt::Vector<Count> v;
+    for ( int64_t i = 0; i < state.range(0); i++ )
+        v.push_back(i);
+
+    for ( auto _ : state )
+        benchmark::DoNotOptimize(rt::to_val(v, ztarget, Location));
+
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+void ToValMap(benchmark::State& state) {
+    auto index = ::zeek::make_intrusive<::zeek::TypeList>(::zeek::base_type(::zeek::TYPE_STRING));
+    index->Append(::zeek::base_type(::zeek::TYPE_STRING));
+    ::zeek::TypePtr target = ::zeek::make_intrusive<::zeek::TableType>(index, ::zeek::base_type(::zeek::TYPE_COUNT));
+
+    hilti::rt::Map<hilti::rt::Bytes, Count> m;
+    for ( int64_t i = 0; i < state.range(0); i++ )
+        m[hilti::rt::Bytes(std::to_string(i))] = i;
+
+    for ( auto _ : state )
+        benchmark::DoNotOptimize(rt::to_val(m, target, Location));
+
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+void ToValSet(benchmark::State& state) {
+    auto index = ::zeek::make_intrusive<::zeek::TypeList>(::zeek::base_type(::zeek::TYPE_STRING));
+    index->Append(::zeek::base_type(::zeek::TYPE_STRING));
+    ::zeek::TypePtr target = ::zeek::make_intrusive<::zeek::SetType>(index, nullptr);
+
+    hilti::rt::Set<hilti::rt::Bytes> s;
+    for ( int64_t i = 0; i < state.range(0); i++ )
+        s.insert(hilti::rt::Bytes(std::to_string(i)));
+
+    for ( auto _ : state )
+        benchmark::DoNotOptimize(rt::to_val(s, target, Location));
+
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+void ToValTuple(benchmark::State& state) {
+    const auto& target = resourceUsageType();
+    auto t = std::make_tuple(hilti::rt::Interval(), hilti::rt::Interval(), Count(1), Count(2), Count(3), Count(4));
+
+    for ( auto _ : state )
+        benchmark::DoNotOptimize(rt::to_val(t, target, Location));
+}
+
+void ToValStruct(benchmark::State& state) {
+    const auto& target = resourceUsageType();
+    ResourceUsage s;
+
+    for ( auto _ : state )
+        benchmark::DoNotOptimize(rt::to_val(s, target, Location));
+}
+
+void ToValEnum(benchmark::State& state) {
+    const auto& target = ::zeek::id::find_type("transport_proto");
+    auto e = Protocol::TCP;
+
+    for ( auto _ : state )
+        benchmark::DoNotOptimize(rt::to_val(e, target, Location));
+}
+
+void RaiseEvent(benchmark::State& state) {
+    // The Zeek-side handlers don't do anything, so that we mostly measure
+    // our own side. They need to exist though, as Zeek won't raise events
+    // without any; run-micro-benchmarks defines them.
+    rt::EventPlan plan;
+    auto name = hilti::rt::fmt("Spicy::__benchmark_event_%" PRId64, state.range(0));
+    plan.handler = ::zeek::event_registry->Lookup(name);
+    if ( ! rt::have_handler(&plan) ) {
+        state.SkipWithError("no handler defined for benchmark event");
+        return;
+    }
+
+    plan.num_args = state.range(0);
+    plan.valid = true;
+    plan.location = Location;
+
+    std::vector<::zeek::ValPtr> vals;
+    for ( int64_t i = 0; i < state.range(0); i++ )
+        vals.push_back(::zeek::val_mgr->Count(i));
+
+    uint64_t n = 0;
+
+    for ( auto _ : state ) {
+        auto args = rt::event_args(&plan);
+        for ( const auto& v : vals )
+            rt::event_arg_add(args, v, Location);
+
+        rt::raise_event(&plan, std::move(args));
+
+        // Keep the event queue from growing without bounds.
+        if ( ++n % 4096 == 0 ) {
+            state.PauseTiming();
+            ::zeek::event_mgr.Drain();
+            state.ResumeTiming();
+        }
+    }
+
+    ::zeek::event_mgr.Drain();
+    state.SetItemsProcessed(state.iterations());
+}
+
+void FileStateStack(benchmark::State& state) {
+    // Pushes, looks up, and removes a given number of concurrent files.
+    rt::cookie::FileStateStack stack([]() { return std::string("benchmark"); });
+    std::vector<std::string> fids(state.range(0));
+
+    for ( auto _ : state ) {
+        for ( auto& fid : fids )
+            fid = stack.push()->fid;
+
+        for ( const auto& fid : fids )
+            benchmark::DoNotOptimize(stack.find(fid));
+
+        for ( const auto& fid : fids )
+            stack.remove(fid);
+    }
+
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+void registerBenchmarks() {
+    benchmark::RegisterBenchmark("to_val/count", ToValCount);
+    benchmark::RegisterBenchmark("to_val/int", ToValInt);
+    benchmark::RegisterBenchmark("to_val/bytes", ToValBytes)->RangeMultiplier(4)->Range(16, 1 << 20);
+    benchmark::RegisterBenchmark("to_val/vector", ToValVector)->RangeMultiplier(8)->Range(8, 4096);
+    benchmark::RegisterBenchmark("to_val/map", ToValMap)->RangeMultiplier(8)->Range(8, 4096);
+    benchmark::RegisterBenchmark("to_val/set", ToValSet)->RangeMultiplier(8)->Range(8, 4096);
+    benchmark::RegisterBenchmark("to_val/tuple", ToValTuple);
+    benchmark::RegisterBenchmark("to_val/struct", ToValStruct);
+    benchmark::RegisterBenchmark("to_val/enum", ToValEnum);
+    benchmark::RegisterBenchmark("raise_event", RaiseEvent)->Arg(0)->Arg(1)->Arg(4)->Arg(16);
+    benchmark::RegisterBenchmark("file_state_stack", FileStateStack)->Arg(1)->Arg(4)->Arg(16)->Arg(64);
+}
+
+} // namespace
+
+bool benchmarks::run(const std::vector<std::string>& args) {
+    static bool registered = false;
+    if ( ! registered ) {
+        registerBenchmarks();
+        registered = true;
+    }
+
+    std::vector<std::string> storage = {"zeek"};
+    storage.insert(storage.end(), args.begin(), args.end());
+
+    std::vector<char*> argv;
+    for ( auto& a : storage )
+        argv.push_back(a.data());
+
+    auto argc = static_cast<int>(argv.size());
+    benchmark::Initialize(&argc, argv.data());
+    if ( benchmark::ReportUnrecognizedArguments(argc, argv.data()) )
+        return false;
+
+    benchmark::RunSpecifiedBenchmarks();
+    return true;
+}
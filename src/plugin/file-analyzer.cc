@@ -32,14 +32,15 @@ static auto create_file_state(FileAnalyzer* analyzer) {
 
     cookie::FileAnalyzer cookie{.analyzer = analyzer,
                                 .depth = depth,
-                                .fstate = cookie::FileStateStack(analyzer->GetFile()->GetID())};
+                                .fstate =
+                                    cookie::FileStateStack([analyzer]() { return analyzer->GetFile()->GetID(); })};
     return FileState(cookie);
 }
 
 FileAnalyzer::FileAnalyzer(::zeek::RecordValPtr args, ::zeek::file_analysis::File* file)
     : ::zeek::file_analysis::Analyzer(std::move(args), file), _state(create_file_state(this)) {}
 
-FileAnalyzer::~FileAnalyzer() {}
+FileAnalyzer::~FileAnalyzer() { _memory.release(_memory_total); }
 
 void FileAnalyzer::Init() {}
 
@@ -69,8 +70,18 @@ bool FileAnalyzer::Process(int len, const u_char* data) {
     if ( ! _state.hasParser() && ! _state.isSkipping() ) {
         auto parser = OurPlugin->parserForFileAnalyzer(_state.cookie().analyzer->Tag());
         ;
-        if ( parser )
+        if ( parser ) {
             _state.setParser(parser);
+            _controls = OurPlugin->controlsForFileAnalyzer(_state.cookie().analyzer->Tag());
+
+            if ( ::zeek::BifConst::Spicy::max_total_memory ) {
+                if ( auto* stats = OurPlugin->statsForFileAnalyzer(_state.cookie().analyzer->Tag()) )
+                    _memory_total = &stats->memory;
+            }
+
+            if ( ::zeek::BifConst::Spicy::enable_analyzer_stats )
+                _state.cookie().stats = OurPlugin->statsForFileAnalyzer(_state.cookie().analyzer->Tag());
+        }
         else {
             STATE_DEBUG_MSG("no unit specified for parsing");
             _state.skipRemaining();
@@ -78,6 +89,15 @@ bool FileAnalyzer::Process(int len, const u_char* data) {
         }
     }
 
+    if ( _state.isSkipping() )
+        return false;
+
+    if ( _controls && _controls->shed ) {
+        STATE_DEBUG_MSG("shedding load, skipping all further input");
+        _state.skipRemaining();
+        return false;
+    }
+
     auto* file = _state.cookie().analyzer->GetFile();
 
     const auto& max_file_depth = ::zeek::BifConst::Spicy::max_file_depth;
@@ -99,11 +119,21 @@ bool FileAnalyzer::Process(int len, const u_char* data) {
         return false;
     }
 
+    _state.cookie().file_val = nullptr; // cache is scoped to the current round
+    StatsRecorder recorder(_state.cookie().stats, len);
+    const auto& max_total_memory = ::zeek::BifConst::Spicy::max_total_memory;
+    const auto heap_before = (max_total_memory ? MemoryAccount::heapSize() : 0);
+
     try {
         hilti::rt::context::CookieSetter _(&_state.cookie());
+        EventFlusher flusher;
         _state.process(len, reinterpret_cast<const char*>(data));
     } catch ( const hilti::rt::RuntimeError& e ) {
         STATE_DEBUG_MSG(hilti::rt::fmt("error during parsing, triggering analyzer violation: %s", e.what()));
+
+        if ( auto* stats = _state.cookie().stats )
+            ++stats->violations;
+
         auto tag = OurPlugin->tagForFileAnalyzer(_state.cookie().analyzer->Tag());
 #if ZEEK_VERSION_NUMBER >= 50200
         AnalyzerViolation(e.what(), reinterpret_cast<const char*>(data), len, tag);
@@ -112,19 +142,54 @@ bool FileAnalyzer::Process(int len, const u_char* data) {
 #endif
     } catch ( const hilti::rt::Exception& e ) {
         STATE_DEBUG_MSG(e.what());
+
+        if ( auto* stats = _state.cookie().stats )
+            ++stats->exceptions;
+
         reporter::analyzerError(_state.cookie().analyzer, e.description(),
                                 e.location()); // this sets Zeek to skip sending any further input
     }
 
+    if ( max_total_memory && ! checkMemory(heap_before) )
+        return false;
+
     return true;
 }
 
+bool FileAnalyzer::checkMemory(uint64_t heap_before) {
+    const auto heap_after = MemoryAccount::heapSize();
+    _memory.record(heap_before, heap_after, _memory_total);
+
+    // Only the actual heap size decides, not the approximate amount attributed to us.
+    if ( heap_after <= ::zeek::BifConst::Spicy::max_total_memory )
+        return true;
+
+    auto addl = hilti::rt::fmt("%" PRIu64 " bytes", heap_after);
+    STATE_DEBUG_MSG(hilti::rt::fmt("heap size %s exceeds limit, skipping all further input", addl));
+
+    {
+        hilti::rt::context::CookieSetter _(&_state.cookie());
+        rt::weird("spicy_total_memory_exceeded", addl);
+    }
+
+    _state.skipRemaining();
+    return false;
+}
+
 void FileAnalyzer::Finish() {
+    _state.cookie().file_val = nullptr; // cache is scoped to the current round
+    StatsRecorder recorder(_state.cookie().stats, 0);
+
     try {
         hilti::rt::context::CookieSetter _(&_state.cookie());
+        EventFlusher flusher;
         _state.finish();
     } catch ( const hilti::rt::RuntimeError& e ) {
         STATE_DEBUG_MSG(hilti::rt::fmt("error during parsing, triggering analyzer violation: %s", e.what()));
+
+        if ( auto* stats = _state.cookie().stats )
+            ++stats->violations;
+
         auto tag = OurPlugin->tagForFileAnalyzer(_state.cookie().analyzer->Tag());
 #if ZEEK_VERSION_NUMBER >= 50200
         AnalyzerViolation(e.what(), "", 0, tag);
@@ -132,6 +197,9 @@ void FileAnalyzer::Finish() {
         // We don't have an an appropiate way to report this with older Zeeks.
 #endif
     } catch ( const hilti::rt::Exception& e ) {
+        if ( auto* stats = _state.cookie().stats )
+            ++stats->exceptions;
+
         reporter::analyzerError(_state.cookie().analyzer, e.description(),
                                 e.location()); // this sets Zeek to skip sending any further input
     }
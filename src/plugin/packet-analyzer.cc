@@ -1,11 +1,16 @@
 // Copyright (c) 2020-2021 by the Zeek Project. See LICENSE for details.
 
+#include <optional>
+#include <string>
+
 #include <zeek-spicy/autogen/config.h>
 #include <zeek-spicy/plugin/packet-analyzer.h>
 #include <zeek-spicy/plugin/plugin.h>
 #include <zeek-spicy/plugin/runtime-support.h>
 #include <zeek-spicy/plugin/zeek-reporter.h>
 
+#include "consts.bif.h"
+
 #ifndef NDEBUG
 #define STATE_DEBUG_MSG(...) DebugMsg(__VA_ARGS__)
 #else
@@ -30,44 +35,70 @@ PacketAnalyzer::PacketAnalyzer(std::string name)
 PacketAnalyzer::~PacketAnalyzer() = default;
 
 bool PacketAnalyzer::AnalyzePacket(size_t len, const uint8_t* data, ::zeek::Packet* packet) {
-    if ( auto parser = OurPlugin->parserForPacketAnalyzer(_state.cookie().analyzer->GetAnalyzerTag()) )
-        _state.setParser(parser);
-    else
-        reporter::fatalError("no valid unit specified for parsing");
-
-    try {
-        hilti::rt::context::CookieSetter _(&_state.cookie());
-        _state.cookie().next_analyzer.reset();
-        _state.cookie().packet = packet;
-        _state.process(len, reinterpret_cast<const char*>(data));
-        auto offset = _state.finish();
-        assert(offset);
-        _state.cookie().packet = nullptr;
-        _state.cookie().packet_val = nullptr;
-        _state.reset();
-        auto num_processed = offset->Ref();
-        const auto& next_analyzer = _state.cookie().next_analyzer;
-        STATE_DEBUG_MSG(hilti::rt::fmt("processed %" PRIu64 " out of %" PRIu64 " bytes, %s", num_processed, len,
-                                       (next_analyzer ? hilti::rt::fmt("next analyzer is 0x%" PRIx32, *next_analyzer) :
-                                                        std::string("no next analyzer"))));
-        if ( next_analyzer )
-            return ForwardPacket(len - num_processed, data + num_processed, packet, *next_analyzer);
+    if ( ! _state.hasParser() ) {
+        // Look up the parser only once; resetting the state between packets retains it.
+        if ( auto parser = OurPlugin->parserForPacketAnalyzer(_state.cookie().analyzer->GetAnalyzerTag()) )
+            _state.setParser(parser);
         else
-            return true;
-    } catch ( const hilti::rt::RuntimeError& e ) {
-        STATE_DEBUG_MSG(hilti::rt::fmt("error during parsing, triggering analyzer violation: %s", e.what()));
-        auto tag = _state.cookie().analyzer->GetAnalyzerTag();
+            reporter::fatalError("no valid unit specified for parsing");
 
-        if ( auto* session = packet->session )
-            _state.cookie().analyzer->AnalyzerViolation(e.what(), session, reinterpret_cast<const char*>(data), len, tag);
+        if ( ::zeek::BifConst::Spicy::enable_analyzer_stats )
+            _state.cookie().stats = OurPlugin->statsForPacketAnalyzer(_state.cookie().analyzer->GetAnalyzerTag());
+    }
 
+    std::optional<uint64_t> num_processed;
+
+    {
+        StatsRecorder recorder(_state.cookie().stats, len);
+
+        try {
+            hilti::rt::context::CookieSetter _(&_state.cookie());
+            _state.cookie().next_analyzer.reset();
+            _state.cookie().packet = packet;
+            _state.process(len, reinterpret_cast<const char*>(data));
+            auto offset = _state.finish();
+            assert(offset);
+            num_processed = offset->Ref();
+        } catch ( const hilti::rt::RuntimeError& e ) {
+            STATE_DEBUG_MSG(hilti::rt::fmt("error during parsing, triggering analyzer violation: %s", e.what()));
+
+            if ( auto* stats = _state.cookie().stats )
+                ++stats->violations;
+
+            auto tag = _state.cookie().analyzer->GetAnalyzerTag();
+
+            if ( auto* session = packet->session )
+                _state.cookie().analyzer->AnalyzerViolation(e.what(), session, reinterpret_cast<const char*>(data),
+                                                            len, tag);
+        } catch ( const hilti::rt::Exception& e ) {
+            STATE_DEBUG_MSG(e.what());
+
+            if ( auto* stats = _state.cookie().stats )
+                ++stats->exceptions;
+
+            reporter::analyzerError(_state.cookie().analyzer, e.description(),
+                                    e.location()); // this sets Zeek to skip sending any further input
+        }
+
+        // Release everything pertaining to this packet, no matter if parsing
+        // succeeded, so that the next packet starts from a clean state. This
+        // retains the parser, so there's no need to look it up again.
+        _state.cookie().packet = nullptr;
+        _state.cookie().packet_val = nullptr;
         _state.reset();
-        return false;
-    } catch ( const hilti::rt::Exception& e ) {
-        STATE_DEBUG_MSG(e.what());
-        reporter::analyzerError(_state.cookie().analyzer, e.description(),
-                                e.location()); // this sets Zeek to skip sending any further input
-        _state.reset();
-        return false;
     }
+
+    if ( ! num_processed )
+        return false;
+
+    // We forward only once we're done with our own state, so that the next
+    // analyzer doesn't run nested inside our parsing context.
+    const auto& next_analyzer = _state.cookie().next_analyzer;
+    STATE_DEBUG_MSG(hilti::rt::fmt("processed %" PRIu64 " out of %" PRIu64 " bytes, %s", *num_processed, len,
+                                   (next_analyzer ? hilti::rt::fmt("next analyzer is 0x%" PRIx32, *next_analyzer) :
+                                                    std::string("no next analyzer"))));
+    if ( next_analyzer )
+        return ForwardPacket(len - *num_processed, data + *num_processed, packet, *next_analyzer);
+    else
+        return true;
 }
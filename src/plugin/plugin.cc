@@ -25,6 +25,7 @@
 #include <zeek-spicy/plugin/packet-analyzer.h>
 #include <zeek-spicy/plugin/plugin.h>
 #include <zeek-spicy/plugin/protocol-analyzer.h>
+#include <zeek-spicy/plugin/runtime-support.h>
 #include <zeek-spicy/plugin/zeek-compat.h>
 #include <zeek-spicy/plugin/zeek-reporter.h>
 
@@ -303,6 +304,12 @@ void plugin::Zeek_Spicy::Plugin::registerEvent(const std::string& name) {
         _events[name] = ::zeek::detail::install_ID(name.c_str(), mod.c_str(), false, true);
 }
 
+const spicy::zeek::rt::EventPlan* plugin::Zeek_Spicy::Plugin::registerEventPlan(
+    std::unique_ptr<spicy::zeek::rt::EventPlan> plan) {
+    _event_plans.push_back(std::move(plan));
+    return _event_plans.back().get();
+}
+
 const spicy::rt::Parser* plugin::Zeek_Spicy::Plugin::parserForProtocolAnalyzer(const ::zeek::Tag& tag, bool is_orig) {
     if ( is_orig )
         return _protocol_analyzers_by_type[tag.Type()].parser_orig;
@@ -318,6 +325,63 @@ const spicy::rt::Parser* plugin::Zeek_Spicy::Plugin::parserForPacketAnalyzer(con
     return _packet_analyzers_by_type[tag.Type()].parser;
 }
 
+spicy::zeek::rt::AnalyzerStats* plugin::Zeek_Spicy::Plugin::statsForProtocolAnalyzer(const ::zeek::Tag& tag) {
+    if ( tag.Type() >= _protocol_analyzers_by_type.size() )
+        return nullptr;
+
+    return &_protocol_analyzers_by_type[tag.Type()].stats;
+}
+
+spicy::zeek::rt::AnalyzerStats* plugin::Zeek_Spicy::Plugin::statsForFileAnalyzer(const ::zeek::Tag& tag) {
+    if ( tag.Type() >= _file_analyzers_by_type.size() )
+        return nullptr;
+
+    return &_file_analyzers_by_type[tag.Type()].stats;
+}
+
+spicy::zeek::rt::AnalyzerStats* plugin::Zeek_Spicy::Plugin::statsForPacketAnalyzer(const ::zeek::Tag& tag) {
+    if ( tag.Type() >= _packet_analyzers_by_type.size() )
+        return nullptr;
+
+    return &_packet_analyzers_by_type[tag.Type()].stats;
+}
+
+const spicy::zeek::rt::AnalyzerControls* plugin::Zeek_Spicy::Plugin::controlsForProtocolAnalyzer(
+    const ::zeek::Tag& tag) {
+    if ( tag.Type() >= _protocol_analyzers_by_type.size() )
+        return nullptr;
+
+    return &_protocol_analyzers_by_type[tag.Type()].controls;
+}
+
+const spicy::zeek::rt::AnalyzerControls* plugin::Zeek_Spicy::Plugin::controlsForFileAnalyzer(const ::zeek::Tag& tag) {
+    if ( tag.Type() >= _file_analyzers_by_type.size() )
+        return nullptr;
+
+    return &_file_analyzers_by_type[tag.Type()].controls;
+}
+
+std::vector<std::pair<std::string, spicy::zeek::rt::AnalyzerStats>> plugin::Zeek_Spicy::Plugin::analyzerStats() const {
+    std::vector<std::pair<std::string, spicy::zeek::rt::AnalyzerStats>> stats;
+
+    for ( const auto& a : _protocol_analyzers_by_type ) {
+        if ( a.type != 0 ) // vector element not set otherwise
+            stats.emplace_back(a.name_analyzer, a.stats);
+    }
+
+    for ( const auto& a : _file_analyzers_by_type ) {
+        if ( a.type != 0 ) // vector element not set otherwise
+            stats.emplace_back(a.name_analyzer, a.stats);
+    }
+
+    for ( const auto& a : _packet_analyzers_by_type ) {
+        if ( a.type != 0 ) // vector element not set otherwise
+            stats.emplace_back(a.name_analyzer, a.stats);
+    }
+
+    return stats;
+}
+
 ::zeek::Tag plugin::Zeek_Spicy::Plugin::tagForProtocolAnalyzer(const ::zeek::Tag& tag) {
     if ( auto r = _protocol_analyzers_by_type[tag.Type()].replaces )
         return r;
@@ -467,6 +531,27 @@ bool plugin::Zeek_Spicy::Plugin::togglePacketAnalyzer(const ::zeek::Tag& tag, bo
 #endif
 }
 
+bool plugin::Zeek_Spicy::Plugin::shedAnalyzer(const std::string& name, bool shed) {
+    auto set_shed = [&](auto& analyzers, const char* kind) {
+        for ( auto& a : analyzers ) {
+            if ( a.type == 0 || a.name_analyzer != name ) // vector element not set, or not the one we want
+                continue;
+
+            if ( a.controls.shed != shed ) {
+                ZEEK_DEBUG(hilti::rt::fmt("%s shedding load for Spicy %s analyzer %s", (shed ? "Starting" : "Stopping"),
+                                          kind, name));
+                a.controls.shed = shed;
+            }
+
+            return true;
+        }
+
+        return false;
+    };
+
+    return set_shed(_protocol_analyzers_by_type, "protocol") || set_shed(_file_analyzers_by_type, "file");
+}
+
 bool plugin::Zeek_Spicy::Plugin::toggleAnalyzer(::zeek::EnumVal* tag, bool enable) {
     if ( tag->GetType() == ::zeek::analyzer_mgr->GetTagType() ) {
         if ( auto analyzer = ::zeek::analyzer_mgr->Lookup(tag) )
@@ -552,6 +637,7 @@ static void hook_accept_input() {
     if ( auto x = std::get_if<rt::cookie::ProtocolAnalyzer>(cookie) ) {
         auto tag = plugin::Zeek_Spicy::OurPlugin->tagForProtocolAnalyzer(x->analyzer->GetAnalyzerTag());
         ZEEK_DEBUG(hilti::rt::fmt("confirming protocol %s", tag.AsString()));
+        rt::flush_events(cookie); // deliver events raised so far first
         return x->analyzer->AnalyzerConfirmation(tag);
     }
 }
@@ -563,6 +649,7 @@ static void hook_decline_input(const std::string& reason) {
     if ( auto x = std::get_if<rt::cookie::ProtocolAnalyzer>(cookie) ) {
         auto tag = plugin::Zeek_Spicy::OurPlugin->tagForProtocolAnalyzer(x->analyzer->GetAnalyzerTag());
         ZEEK_DEBUG(hilti::rt::fmt("rejecting protocol %s", tag.AsString()));
+        rt::flush_events(cookie); // deliver events raised so far first
         return x->analyzer->AnalyzerViolation("protocol rejected", nullptr, 0, tag);
     }
 }
@@ -599,8 +686,19 @@ void plugin::Zeek_Spicy::Plugin::InitPostScript() {
     hilti_config.abort_on_exceptions = ::zeek::id::find_const("Spicy::abort_on_exceptions")->AsBool();
     hilti_config.show_backtraces = ::zeek::id::find_const("Spicy::show_backtraces")->AsBool();
 
+    if ( auto n = ::zeek::id::find_const("Spicy::fiber_cache_size")->AsCount() )
+        hilti_config.fiber_cache_size = n;
+
+#if SPICY_VERSION_NUMBER >= 10500
+    if ( auto n = ::zeek::id::find_const("Spicy::fiber_stack_swap_size_min")->AsCount() )
+        hilti_config.fiber_shared_stack_swap_size_min = n;
+#endif
+
     hilti::rt::configuration::set(hilti_config);
 
+    if ( ::zeek::id::find_const("Spicy::max_total_memory")->AsCount() && ! rt::MemoryAccount::haveHeapSize() )
+        reporter::warning("Spicy::max_total_memory is not supported on this platform, ignoring it");
+
 #if SPICY_VERSION_NUMBER >= 10700
     auto spicy_config = spicy::rt::configuration::get();
     spicy_config.hook_accept_input = hook_accept_input;
@@ -623,16 +721,29 @@ void plugin::Zeek_Spicy::Plugin::InitPostScript() {
         exit(1);
     }
 
+    // Index all available parsers by name and linker scope once, so that
+    // resolving the analyzers' parsers below doesn't need to scan the list.
+    auto parser_key = [](const std::string& name, const std::string& linker_scope) {
+        return linker_scope + '\0' + name;
+    };
+
+    std::unordered_map<std::string, const spicy::rt::Parser*> parsers_by_name;
+    parsers_by_name.reserve(spicy::rt::parsers().size());
+
+    for ( auto p : spicy::rt::parsers() ) {
+        if ( auto [x, inserted] = parsers_by_name.emplace(parser_key(p->name, p->linker_scope), p); ! inserted )
+            // Keep the first one, as we'd have found it first before, too.
+            reporter::warning(hilti::rt::fmt("Spicy parser '%s' registered more than once", p->name));
+    }
+
     // Fill in the parser information now that we derived from the ASTs.
-    auto find_parser = [](const std::string& analyzer, const std::string& parser,
-                          const std::string& linker_scope) -> const spicy::rt::Parser* {
+    auto find_parser = [&](const std::string& analyzer, const std::string& parser,
+                           const std::string& linker_scope) -> const spicy::rt::Parser* {
         if ( parser.empty() )
             return nullptr;
 
-        for ( auto p : spicy::rt::parsers() ) {
-            if ( p->name == parser && p->linker_scope == linker_scope )
-                return p;
-        }
+        if ( auto p = parsers_by_name.find(parser_key(parser, linker_scope)); p != parsers_by_name.end() )
+            return p->second;
 
         reporter::internalError(
             hilti::rt::fmt("Unknown Spicy parser '%s' requested by analyzer '%s'", parser, analyzer));
@@ -720,6 +831,18 @@ void plugin::Zeek_Spicy::Plugin::InitPostScript() {
 
 
 void plugin::Zeek_Spicy::Plugin::Done() {
+    if ( ::zeek::id::find_const("Spicy::enable_analyzer_stats")->AsBool() ) {
+        for ( const auto& [name, s] : analyzerStats() )
+            ZEEK_DEBUG(hilti::rt::fmt("analyzer stats for %s: time=%" PRIu64 "ns bytes=%" PRIu64 " chunks=%" PRIu64
+                                      " events=%" PRIu64 " violations=%" PRIu64 " exceptions=%" PRIu64
+                                      " memory=%" PRIu64,
+                                      name, s.time_ns, s.bytes, s.chunks, s.events, s.violations, s.exceptions,
+                                      s.memory));
+    }
+
+    ZEEK_DEBUG(hilti::rt::fmt("$conn/$file value cache: %" PRIu64 " hits, %" PRIu64 " misses",
+                              spicy::zeek::rt::value_cache_stats.hits, spicy::zeek::rt::value_cache_stats.misses));
+
     ZEEK_DEBUG("Shutting down Spicy runtime");
     spicy::rt::done();
     hilti::rt::done();
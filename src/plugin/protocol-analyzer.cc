@@ -7,6 +7,8 @@
 #include <zeek-spicy/plugin/zeek-compat.h>
 #include <zeek-spicy/plugin/zeek-reporter.h>
 
+#include "consts.bif.h"
+
 using namespace spicy::zeek;
 using namespace spicy::zeek::rt;
 using namespace plugin::Zeek_Spicy;
@@ -20,11 +22,13 @@ using namespace plugin::Zeek_Spicy;
 void EndpointState::debug(const std::string& msg) { spicy::zeek::rt::debug(_cookie, msg); }
 
 static auto create_endpoint(bool is_orig, ::zeek::analyzer::Analyzer* analyzer, spicy::rt::driver::ParsingType type) {
+    auto id = analyzer->GetID();
     cookie::ProtocolAnalyzer cookie{.analyzer = analyzer,
                                     .is_orig = is_orig,
-                                    .fstate_orig = cookie::FileStateStack(hilti::rt::fmt("%x.orig", analyzer->GetID())),
+                                    .fstate_orig =
+                                        cookie::FileStateStack([id]() { return hilti::rt::fmt("%x.orig", id); }),
                                     .fstate_resp =
-                                        cookie::FileStateStack(hilti::rt::fmt("%x.resp", analyzer->GetID()))};
+                                        cookie::FileStateStack([id]() { return hilti::rt::fmt("%x.resp", id); })};
 
     // Cannot get parser here yet, analyzer may not have been fully set up.
     return EndpointState(cookie, type);
@@ -33,25 +37,48 @@ static auto create_endpoint(bool is_orig, ::zeek::analyzer::Analyzer* analyzer,
 ProtocolAnalyzer::ProtocolAnalyzer(::zeek::analyzer::Analyzer* analyzer, spicy::rt::driver::ParsingType type)
     : _originator(create_endpoint(true, analyzer, type)), _responder(create_endpoint(false, analyzer, type)) {}
 
-ProtocolAnalyzer::~ProtocolAnalyzer() {}
+ProtocolAnalyzer::~ProtocolAnalyzer() { _memory.release(_memory_total); }
+
+void ProtocolAnalyzer::Init() { resolveParsers(); }
+
+void ProtocolAnalyzer::resolveParsers() {
+    if ( _resolved )
+        return;
+
+    const auto& tag = _originator.cookie().analyzer->GetAnalyzerTag();
+    _parser_orig = OurPlugin->parserForProtocolAnalyzer(tag, true);
+    _parser_resp = OurPlugin->parserForProtocolAnalyzer(tag, false);
 
-void ProtocolAnalyzer::Init() {}
+    if ( ::zeek::BifConst::Spicy::enable_analyzer_stats )
+        _stats = OurPlugin->statsForProtocolAnalyzer(tag);
+
+    _controls = OurPlugin->controlsForProtocolAnalyzer(tag);
+
+    if ( ::zeek::BifConst::Spicy::max_total_memory ) {
+        if ( auto* stats = OurPlugin->statsForProtocolAnalyzer(tag) )
+            _memory_total = &stats->memory;
+    }
+
+    _resolved = true;
+}
 
 void ProtocolAnalyzer::Done() {}
 
 void ProtocolAnalyzer::Process(bool is_orig, int len, const u_char* data) {
     auto* endp = is_orig ? &_originator : &_responder;
 
-    if ( endp->cookie().analyzer->Skipping() )
+    if ( endp->cookie().analyzer->Skipping() || endp->isSkipping() )
         return;
 
-    if ( ! endp->hasParser() && ! endp->isSkipping() ) {
-        auto parser = OurPlugin->parserForProtocolAnalyzer(endp->cookie().analyzer->GetAnalyzerTag(), is_orig);
-        if ( parser ) {
+    if ( ! endp->hasParser() ) {
+        resolveParsers(); // no-op if Init() did it already
+
+        if ( auto parser = (is_orig ? _parser_orig : _parser_resp) ) {
             if ( ! _context )
                 _context = parser->createContext();
 
             endp->setParser(parser, _context);
+            endp->cookie().stats = _stats;
         }
         else {
             STATE_DEBUG_MSG(is_orig, "no unit specified for parsing");
@@ -60,20 +87,66 @@ void ProtocolAnalyzer::Process(bool is_orig, int len, const u_char* data) {
         }
     }
 
+    if ( _controls && _controls->shed ) {
+        STATE_DEBUG_MSG(is_orig, "shedding load, skipping all further input");
+        originator().skipRemaining();
+        responder().skipRemaining();
+        endp->cookie().analyzer->SetSkip(true);
+        return;
+    }
+
+    endp->cookie().conn_val = nullptr; // Zeek may have updated the connection since the last round
+    StatsRecorder recorder(endp->cookie().stats, data ? len : 0); // gaps don't count as input
+    const auto& max_total_memory = ::zeek::BifConst::Spicy::max_total_memory;
+    const auto heap_before = (max_total_memory ? MemoryAccount::heapSize() : 0);
+
     try {
         hilti::rt::context::CookieSetter _(&endp->cookie());
+        EventFlusher flusher;
         endp->process(len, reinterpret_cast<const char*>(data));
     } catch ( const hilti::rt::RuntimeError& e ) {
         STATE_DEBUG_MSG(is_orig, hilti::rt::fmt("error during parsing, triggering analyzer violation: %s", e.what()));
+
+        if ( auto* stats = endp->cookie().stats )
+            ++stats->violations;
+
         auto tag = OurPlugin->tagForProtocolAnalyzer(endp->cookie().analyzer->GetAnalyzerTag());
         endp->cookie().analyzer->AnalyzerViolation(e.what(), reinterpret_cast<const char*>(data), len, tag);
         originator().skipRemaining();
         responder().skipRemaining();
         endp->cookie().analyzer->SetSkip(true);
     } catch ( const hilti::rt::Exception& e ) {
+        if ( auto* stats = endp->cookie().stats )
+            ++stats->exceptions;
+
         reporter::analyzerError(endp->cookie().analyzer, e.description(),
                                 e.location()); // this sets Zeek to skip sending any further input
     }
+
+    if ( max_total_memory )
+        checkMemory(endp, heap_before);
+}
+
+void ProtocolAnalyzer::checkMemory(EndpointState* endp, uint64_t heap_before) {
+    const auto heap_after = MemoryAccount::heapSize();
+    _memory.record(heap_before, heap_after, _memory_total);
+
+    // Only the actual heap size decides, not the approximate amount attributed to us.
+    if ( heap_after <= ::zeek::BifConst::Spicy::max_total_memory )
+        return;
+
+    auto addl = hilti::rt::fmt("%" PRIu64 " bytes", heap_after);
+    STATE_DEBUG_MSG(endp->cookie().is_orig,
+                    hilti::rt::fmt("heap size %s exceeds limit, skipping all further input", addl));
+
+    {
+        hilti::rt::context::CookieSetter _(&endp->cookie());
+        rt::weird("spicy_total_memory_exceeded", addl);
+    }
+
+    originator().skipRemaining();
+    responder().skipRemaining();
+    endp->cookie().analyzer->SetSkip(true);
 }
 
 void ProtocolAnalyzer::Finish(bool is_orig) {
@@ -82,15 +155,26 @@ void ProtocolAnalyzer::Finish(bool is_orig) {
     if ( endp->cookie().analyzer->Skipping() )
         return;
 
+    endp->cookie().conn_val = nullptr; // Zeek may have updated the connection since the last round
+    StatsRecorder recorder(endp->cookie().stats, 0);
+
     try {
         hilti::rt::context::CookieSetter _(&endp->cookie());
+        EventFlusher flusher;
         endp->finish();
     } catch ( const hilti::rt::RuntimeError& e ) {
         STATE_DEBUG_MSG(is_orig, hilti::rt::fmt("error during parsing, triggering analyzer violation: %s", e.what()));
+
+        if ( auto* stats = endp->cookie().stats )
+            ++stats->violations;
+
         auto tag = OurPlugin->tagForProtocolAnalyzer(endp->cookie().analyzer->GetAnalyzerTag());
         endp->cookie().analyzer->AnalyzerViolation(e.what(), nullptr, 0, tag);
         endp->skipRemaining();
     } catch ( const hilti::rt::Exception& e ) {
+        if ( auto* stats = endp->cookie().stats )
+            ++stats->exceptions;
+
         reporter::analyzerError(endp->cookie().analyzer, e.description(),
                                 e.location()); // this sets Zeek to skip sending any further input
     }
@@ -140,16 +224,16 @@ void TCP_Analyzer::DeliverStream(int len, const u_char* data, bool is_orig) {
 
     Process(is_orig, len, data);
 
-    if ( originator().isFinished() && responder().isFinished() &&
-         (! originator().isSkipping() || ! responder().isSkipping()) ) {
-        STATE_DEBUG_MSG(is_orig, "both endpoints finished, skipping all further TCP processing");
+    // Once neither side has anything left to parse, we detach from the
+    // stream: Zeek won't pass any further data into the analyzer then, so
+    // subsequent segments bypass the Spicy state entirely.
+    auto done = [](EndpointState& endp) { return endp.isFinished() || endp.isSkipping(); };
+
+    if ( done(originator()) && done(responder()) && ! Skipping() ) {
+        STATE_DEBUG_MSG(is_orig, "both endpoints done, skipping all further TCP processing");
         originator().skipRemaining();
         responder().skipRemaining();
-
-        if ( is_orig ) // doesn't really matter which endpoint here.
-            originator().cookie().analyzer->SetSkip(true);
-        else
-            responder().cookie().analyzer->SetSkip(true);
+        SetSkip(true);
     }
 }
 
@@ -1,5 +1,9 @@
 // Copyright (c) 2020-2021 by the Zeek Project. See LICENSE for details.
 
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+
 #include <memory>
 
 #include <hilti/rt/types/port.h>
@@ -11,9 +15,34 @@
 #include <zeek-spicy/plugin/zeek-compat.h>
 #include <zeek-spicy/plugin/zeek-reporter.h>
 
+#include "consts.bif.h"
+
 using namespace spicy::zeek;
 using namespace plugin::Zeek_Spicy;
 
+bool rt::MemoryAccount::haveHeapSize() {
+#if defined(__GLIBC__)
+    return true;
+#else
+    return false;
+#endif
+}
+
+uint64_t rt::MemoryAccount::heapSize() {
+#if defined(__GLIBC__)
+#if __GLIBC_PREREQ(2, 33)
+    const auto mi = ::mallinfo2();
+    return mi.uordblks + mi.hblkhd;
+#else
+    // The older interface reports in ints, which wrap beyond 4GB.
+    const auto mi = ::mallinfo();
+    return static_cast<uint64_t>(static_cast<unsigned int>(mi.uordblks)) + static_cast<unsigned int>(mi.hblkhd);
+#endif
+#else
+    return 0;
+#endif
+}
+
 void rt::register_protocol_analyzer(const std::string& name, hilti::rt::Protocol proto,
                                     const hilti::rt::Vector<hilti::rt::Port>& ports, const std::string& parser_orig,
                                     const std::string& parser_resp, const std::string& replaces,
@@ -146,49 +175,105 @@ void rt::install_handler(const std::string& name) { OurPlugin->registerEvent(nam
     return handler;
 }
 
-void rt::raise_event(const ::zeek::EventHandlerPtr& handler, const hilti::rt::Vector<::zeek::ValPtr>& args,
-                     const std::string& location) {
-    // Caller must have checked already that there's a handler availale.
-    assert(handler);
+rt::EventPlanPtr rt::event_plan(const std::string& name, const hilti::rt::Vector<std::string>& arg_locations,
+                                const std::string& location) {
+    auto plan = std::make_unique<EventPlan>();
+    plan->handler = internal_handler(name);
 
-    const auto zeek_args = const_cast<::zeek::EventHandlerPtr&>(handler)->GetType()->ParamList()->GetTypes();
-    if ( args.size() != static_cast<uint64_t>(zeek_args.size()) )
-        throw TypeMismatch(hilti::rt::fmt("expected %" PRIu64 " parameters, but got %zu",
-                                          static_cast<uint64_t>(zeek_args.size()), args.size()),
-                           location);
+    if ( auto ftype = plan->handler->GetType() )
+        plan->arg_types = ftype->ParamList()->GetTypes();
 
-    ::zeek::Args vl = ::zeek::Args();
-    for ( const auto& v : args ) {
-        if ( v )
-            vl.emplace_back(v);
-        else
-            // Shouldn't happen here, but we have to_vals() that
-            // (legitimately) return null in certain contexts.
-            throw InvalidValue("null value encountered after conversion", location);
-    }
+    plan->num_args = arg_locations.size();
+    plan->valid = (static_cast<uint64_t>(plan->arg_types.size()) == plan->num_args);
+    plan->location = location;
+    plan->arg_locations.assign(arg_locations.begin(), arg_locations.end());
+
+    if ( ! plan->valid )
+        ZEEK_DEBUG(hilti::rt::fmt("event %s expects %zu parameters, but EVT passes %" PRIu64, name,
+                                  plan->arg_types.size(), plan->num_args));
+
+    return OurPlugin->registerEventPlan(std::move(plan));
+}
+
+// Returns the buffer to queue events into for the analyzer associated with a
+// cookie, or null if events are to be passed on to Zeek immediately.
+//
+// Note that any runtime function calling into Zeek in a way that may raise
+// further events, or trigger other analyzers, flushes the current buffer
+// first to retain the original event order.
+static rt::cookie::EventBuffer* _event_buffer(rt::Cookie* cookie) {
+    if ( ! cookie )
+        return nullptr;
+
+    if ( auto c = std::get_if<rt::cookie::ProtocolAnalyzer>(cookie) )
+        return &c->pending_events;
+    else if ( auto f = std::get_if<rt::cookie::FileAnalyzer>(cookie) )
+        return &f->pending_events;
+    else
+        return nullptr;
+}
+
+// Returns the statistics to record into for the analyzer associated with a
+// cookie, or null if not collected.
+static rt::AnalyzerStats* _analyzer_stats(rt::Cookie* cookie) {
+    if ( ! cookie )
+        return nullptr;
+
+    return std::visit([](auto& c) { return c.stats; }, *cookie);
+}
+
+void rt::flush_events(Cookie* cookie) {
+    auto* events = _event_buffer(cookie);
+    if ( ! events || events->empty() )
+        return;
 
-    ::zeek::event_mgr.Enqueue(handler, vl);
+    for ( auto& ev : *events )
+        ::zeek::event_mgr.Enqueue(ev.handler, std::move(ev.args));
+
+    events->clear(); // retains capacity for the next round
 }
 
-::zeek::TypePtr rt::event_arg_type(const ::zeek::EventHandlerPtr& handler,
-                                   const hilti::rt::integer::safe<uint64_t>& idx, const std::string& location) {
-    assert(handler);
+void rt::raise_event(EventPlanPtr plan, ::zeek::Args args) {
+    // Caller must have checked already that there's a handler availale, and
+    // that the arguments match.
+    assert(plan->handler && plan->valid);
+    assert(args.size() == plan->num_args);
+
+    auto cookie = static_cast<Cookie*>(hilti::rt::context::cookie());
 
-    const auto zeek_args = const_cast<::zeek::EventHandlerPtr&>(handler)->GetType()->ParamList()->GetTypes();
-    if ( idx >= static_cast<uint64_t>(zeek_args.size()) )
-        throw TypeMismatch(hilti::rt::fmt("more parameters given than the %" PRIu64 " that the Zeek event expects",
-                                          static_cast<uint64_t>(zeek_args.size())),
-                           location);
+    if ( ::zeek::BifConst::Spicy::enable_analyzer_stats ) {
+        if ( auto* stats = _analyzer_stats(cookie) )
+            ++stats->events;
+    }
 
-    return zeek_args[idx];
+    if ( ::zeek::BifConst::Spicy::batch_events ) {
+        if ( auto* events = _event_buffer(cookie) ) {
+            events->push_back({plan->handler, std::move(args)});
+            return;
+        }
+    }
+
+    ::zeek::event_mgr.Enqueue(plan->handler, std::move(args));
 }
 
+rt::ValueCacheStats rt::value_cache_stats;
+
 ::zeek::ValPtr rt::current_conn(const std::string& location) {
     auto cookie = static_cast<Cookie*>(hilti::rt::context::cookie());
     assert(cookie);
 
-    if ( auto x = std::get_if<cookie::ProtocolAnalyzer>(cookie) )
-        return x->analyzer->Conn()->GetVal();
+    if ( auto x = std::get_if<cookie::ProtocolAnalyzer>(cookie) ) {
+        // We cache the value for the current round of processing, as
+        // retrieving it makes Zeek update the record.
+        if ( x->conn_val )
+            ++value_cache_stats.hits;
+        else {
+            ++value_cache_stats.misses;
+            x->conn_val = x->analyzer->Conn()->GetVal();
+        }
+
+        return x->conn_val;
+    }
     else
         throw ValueUnavailable("$conn not available", location);
 }
@@ -234,8 +319,17 @@ void rt::debug(const Cookie& cookie, const std::string& msg) {
     auto cookie = static_cast<Cookie*>(hilti::rt::context::cookie());
     assert(cookie);
 
-    if ( auto x = std::get_if<cookie::FileAnalyzer>(cookie) )
-        return x->analyzer->GetFile()->ToVal();
+    if ( auto x = std::get_if<cookie::FileAnalyzer>(cookie) ) {
+        // We cache the value for the current round of processing.
+        if ( x->file_val )
+            ++value_cache_stats.hits;
+        else {
+            ++value_cache_stats.misses;
+            x->file_val = x->analyzer->GetFile()->ToVal();
+        }
+
+        return x->file_val;
+    }
     else
         throw ValueUnavailable("$file not available", location);
 }
@@ -323,8 +417,10 @@ void rt::flip_roles() {
 
     rt::debug(*cookie, "flipping roles");
 
-    if ( auto x = std::get_if<cookie::ProtocolAnalyzer>(cookie) )
+    if ( auto x = std::get_if<cookie::ProtocolAnalyzer>(cookie) ) {
         x->analyzer->Conn()->FlipRoles();
+        x->conn_val = nullptr; // Zeek rebuilds the connection record when flipping
+    }
     else
         throw ValueUnavailable("flip_roles() not available in current context");
 }
@@ -343,6 +439,7 @@ hilti::rt::integer::safe<uint64_t> rt::number_packets() {
 void rt::confirm_protocol() {
     auto cookie = static_cast<Cookie*>(hilti::rt::context::cookie());
     assert(cookie);
+    flush_events(cookie);
 
     if ( auto x = std::get_if<cookie::ProtocolAnalyzer>(cookie) ) {
         auto tag = OurPlugin->tagForProtocolAnalyzer(x->analyzer->GetAnalyzerTag());
@@ -355,6 +452,7 @@ void rt::confirm_protocol() {
 void rt::reject_protocol(const std::string& reason) {
     auto cookie = static_cast<Cookie*>(hilti::rt::context::cookie());
     assert(cookie);
+    flush_events(cookie);
 
     if ( auto x = std::get_if<cookie::ProtocolAnalyzer>(cookie) ) {
         auto tag = OurPlugin->tagForProtocolAnalyzer(x->analyzer->GetAnalyzerTag());
@@ -368,6 +466,7 @@ void rt::reject_protocol(const std::string& reason) {
 void rt::weird(const std::string& id, const std::string& addl) {
     auto cookie = static_cast<Cookie*>(hilti::rt::context::cookie());
     assert(cookie);
+    flush_events(cookie);
 
     if ( const auto x = std::get_if<cookie::ProtocolAnalyzer>(cookie) )
         x->analyzer->Weird(id.c_str(), addl.data());
@@ -388,12 +487,16 @@ void rt::protocol_begin(const std::optional<std::string>& analyzer) {
     if ( ! c )
         throw ValueUnavailable("no current connection available");
 
+    flush_events(cookie);
+
     if ( analyzer ) {
-        if ( c->analyzer->Conn()->ConnTransport() != TRANSPORT_TCP ) {
+        if ( c->analyzer->Conn()->ConnTransport() != TRANSPORT_TCP && ! c->fake_tcp ) {
             // Some TCP application analyzer may expect to have access to a TCP
             // analyzer. To make that work, we'll create a fake TCP analyzer,
             // just so that they have something to access. It won't
-            // semantically have any "TCP" to analyze obviously.
+            // semantically have any "TCP" to analyze obviously. We create it
+            // only once and share it between all child analyzers, which also
+            // keeps the pointer that earlier children received valid.
             c->fake_tcp = std::make_shared<::zeek::packet_analysis::TCP::TCPSessionAdapter>(c->analyzer->Conn());
             static_cast<::zeek::analyzer::Analyzer*>(c->fake_tcp.get())
                 ->Done(); // will never see packets; cast to get around protected inheritance
@@ -442,6 +545,8 @@ void rt::protocol_data_in(const hilti::rt::Bool& is_orig, const hilti::rt::Bytes
     if ( ! c )
         throw ValueUnavailable("no current connection available");
 
+    flush_events(cookie);
+
     c->analyzer->ForwardStream(data.size(), reinterpret_cast<const u_char*>(data.data()), is_orig);
 }
 
@@ -454,6 +559,8 @@ void rt::protocol_gap(const hilti::rt::Bool& is_orig, const hilti::rt::integer::
     if ( ! c )
         throw ValueUnavailable("no current connection available");
 
+    flush_events(cookie);
+
     c->analyzer->ForwardUndelivered(is_orig, offset, len);
 }
 
@@ -465,6 +572,8 @@ void rt::protocol_end() {
     if ( ! c )
         throw ValueUnavailable("no current connection available");
 
+    flush_events(cookie);
+
     c->analyzer->ForwardEndOfData(true);
     c->analyzer->ForwardEndOfData(false);
 
@@ -481,7 +590,7 @@ inline rt::cookie::FileStateStack* _file_state_stack(rt::Cookie* cookie) {
         throw rt::ValueUnavailable("no current connection or file available");
 }
 
-inline const rt::cookie::FileState* _file_state(rt::Cookie* cookie, std::optional<std::string> fid) {
+inline const rt::cookie::FileState* _file_state(rt::Cookie* cookie, const std::optional<std::string>& fid) {
     auto* stack = _file_state_stack(cookie);
     if ( fid ) {
         if ( auto* fstate = stack->find(*fid) )
@@ -498,37 +607,99 @@ inline const rt::cookie::FileState* _file_state(rt::Cookie* cookie, std::optiona
 }
 
 rt::cookie::FileState* rt::cookie::FileStateStack::push() {
-    auto fid = ::zeek::file_mgr->HashHandle(hilti::rt::fmt("%s.%d", _analyzer_id, ++_id_counter));
-    _stack.emplace_back(fid);
+    if ( ! _handle_prefix ) {
+        _handle = _make_analyzer_id() + '.';
+        _handle_prefix = _handle.size();
+    }
+
+    // Build "<analyzer-id>.<counter>" in place, reusing the buffer.
+    _handle.resize(_handle_prefix);
+    _handle += std::to_string(++_id_counter);
+
+    _stack.emplace_back(::zeek::file_mgr->HashHandle(_handle));
+
+    if ( ! _index.empty() )
+        _index.emplace(_stack.back().fid, _stack.size() - 1);
+
+    else if ( _stack.size() > IndexThreshold ) {
+        // Switch over to indexed lookups.
+        _index.reserve(_stack.size() * 2);
+        for ( size_t i = 0; i < _stack.size(); i++ )
+            _index.emplace(_stack[i].fid, i);
+    }
+
     return &_stack.back();
 }
 
-const rt::cookie::FileState* rt::cookie::FileStateStack::find(const std::string& fid) const {
+int64_t rt::cookie::FileStateStack::position(const std::string& fid) const {
+    if ( _stack.empty() )
+        return -1;
+
+    // The most recently pushed file is the most likely one to be accessed.
+    if ( _stack.back().fid == fid )
+        return static_cast<int64_t>(_stack.size() - 1);
+
+    if ( ! _index.empty() ) {
+        if ( auto i = _index.find(fid); i != _index.end() )
+            return static_cast<int64_t>(i->second);
+
+        return -1;
+    }
+
     // Reverse search as the default state would be on top of the stack.
-    for ( auto i = _stack.rbegin(); i != _stack.rend(); i++ ) {
-        if ( i->fid == fid )
-            return &*i;
+    for ( auto i = static_cast<int64_t>(_stack.size()) - 2; i >= 0; i-- ) {
+        if ( _stack[i].fid == fid )
+            return i;
     }
 
+    return -1;
+}
+
+const rt::cookie::FileState* rt::cookie::FileStateStack::find(const std::string& fid) const {
+    if ( auto i = position(fid); i >= 0 )
+        return &_stack[i];
+
     return nullptr;
 }
 
 void rt::cookie::FileStateStack::remove(const std::string& fid) {
-    // Reverse search as the default state would be on top of the stack.
-    for ( auto i = _stack.rbegin(); i != _stack.rend(); i++ ) {
-        if ( i->fid == fid ) {
-            _stack.erase((i + 1).base()); // https://stackoverflow.com/a/1830240
-            return;
-        }
+    auto i = position(fid);
+    if ( i < 0 )
+        return;
+
+    if ( _index.empty() ) {
+        _stack.erase(_stack.begin() + i);
+        return;
+    }
+
+    // Note that `fid` may refer to the element we're removing, so we need to
+    // update the index first.
+    _index.erase(fid);
+    _stack.erase(_stack.begin() + i);
+
+    if ( _stack.size() <= IndexThreshold / 2 ) {
+        // Few enough files left to go back to scanning. We leave some slack
+        // to the threshold to not rebuild the index too often.
+        _index.clear();
+        return;
+    }
+
+    // Entries above the removed one have moved down by one.
+    for ( auto& [_, pos] : _index ) {
+        if ( pos > static_cast<size_t>(i) )
+            --pos;
     }
 }
 
 static void _data_in(const char* data, uint64_t len, std::optional<uint64_t> offset,
                      const std::optional<std::string>& fid) {
     auto cookie = static_cast<rt::Cookie*>(hilti::rt::context::cookie());
+    static const std::string no_mime_type;
+
     auto* fstate = _file_state(cookie, fid);
     auto data_ = reinterpret_cast<const unsigned char*>(data);
-    auto mime_type = (fstate->mime_type ? *fstate->mime_type : std::string());
+    const auto& mime_type = (fstate->mime_type ? *fstate->mime_type : no_mime_type);
+    rt::flush_events(cookie);
 
     if ( auto c = std::get_if<rt::cookie::ProtocolAnalyzer>(cookie) ) {
         auto tag = OurPlugin->tagForProtocolAnalyzer(c->analyzer->GetAnalyzerTag());
@@ -549,6 +720,7 @@ static void _data_in(const char* data, uint64_t len, std::optional<uint64_t> off
 void rt::terminate_session() {
     auto cookie = static_cast<Cookie*>(hilti::rt::context::cookie());
     assert(cookie);
+    flush_events(cookie);
 
     if ( auto c = std::get_if<cookie::ProtocolAnalyzer>(cookie) ) {
         assert(::zeek::session_mgr);
@@ -558,6 +730,22 @@ void rt::terminate_session() {
         throw spicy::zeek::rt::ValueUnavailable("terminate_session() not available in the curent context");
 }
 
+void rt::skip_input() {
+    auto cookie = static_cast<Cookie*>(hilti::rt::context::cookie());
+    assert(cookie);
+
+    if ( auto p = std::get_if<cookie::ProtocolAnalyzer>(cookie) ) {
+        rt::debug(*cookie, "skipping all further input");
+        p->analyzer->SetSkip(true);
+    }
+    else if ( auto f = std::get_if<cookie::FileAnalyzer>(cookie) ) {
+        rt::debug(*cookie, "skipping all further input");
+        f->analyzer->SetSkip(true);
+    }
+    else
+        throw spicy::zeek::rt::ValueUnavailable("skip_input() not available in the curent context");
+}
+
 std::string rt::fuid() {
     auto cookie = static_cast<Cookie*>(hilti::rt::context::cookie());
     assert(cookie);
@@ -610,6 +798,7 @@ std::string rt::file_begin(const std::optional<std::string>& mime_type) {
 void rt::file_set_size(const hilti::rt::integer::safe<uint64_t>& size, const std::optional<std::string>& fid) {
     auto cookie = static_cast<Cookie*>(hilti::rt::context::cookie());
     auto* fstate = _file_state(cookie, fid);
+    flush_events(cookie);
 
     if ( auto c = std::get_if<cookie::ProtocolAnalyzer>(cookie) ) {
         auto tag = OurPlugin->tagForProtocolAnalyzer(c->analyzer->GetAnalyzerTag());
@@ -628,10 +817,27 @@ void rt::file_data_in_at_offset(const hilti::rt::Bytes& data, const hilti::rt::i
     _data_in(data.data(), data.size(), offset, fid);
 }
 
+void rt::file_data_in_view(const hilti::rt::stream::View& data, const std::optional<std::string>& fid) {
+    for ( auto block = data.firstBlock(); block; block = data.nextBlock(block) )
+        _data_in(reinterpret_cast<const char*>(block->start), block->size, {}, fid);
+}
+
+void rt::file_data_in_view_at_offset(const hilti::rt::stream::View& data,
+                                     const hilti::rt::integer::safe<uint64_t>& offset,
+                                     const std::optional<std::string>& fid) {
+    uint64_t block_offset = offset;
+
+    for ( auto block = data.firstBlock(); block; block = data.nextBlock(block) ) {
+        _data_in(reinterpret_cast<const char*>(block->start), block->size, block_offset, fid);
+        block_offset += block->size;
+    }
+}
+
 void rt::file_gap(const hilti::rt::integer::safe<uint64_t>& offset, const hilti::rt::integer::safe<uint64_t>& len,
                   const std::optional<std::string>& fid) {
     auto cookie = static_cast<Cookie*>(hilti::rt::context::cookie());
     auto* fstate = _file_state(cookie, fid);
+    flush_events(cookie);
 
     if ( auto c = std::get_if<cookie::ProtocolAnalyzer>(cookie) ) {
         auto tag = OurPlugin->tagForProtocolAnalyzer(c->analyzer->GetAnalyzerTag());
@@ -644,6 +850,7 @@ void rt::file_gap(const hilti::rt::integer::safe<uint64_t>& offset, const hilti:
 void rt::file_end(const std::optional<std::string>& fid) {
     auto cookie = static_cast<Cookie*>(hilti::rt::context::cookie());
     auto* fstate = _file_state(cookie, fid);
+    flush_events(cookie);
 
     ::zeek::file_mgr->EndOfFile(fstate->fid);
     _file_state_stack(cookie)->remove(fstate->fid);